@@ -9,19 +9,94 @@
 #include <fuse.h>
 #include <sys/mman.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE                //linux/fs.h里的BLOCK_SIZE，下面用自己的
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
 
 #define MAX_FILENUM 1024
 #define BLOCKS_INODE 50
-#define TBLOCK 1074
-#define BLOCK_SIZE 4096
+#define BLOCK_SIZE ((ssize_t)1 << blk_shift)        //block大小，挂载时由blocksize参数决定
+#define BLOCK_MASK (BLOCK_SIZE - 1)
+#define PTR_SHIFT (blk_shift - 2)                   //一个索引块能放2^PTR_SHIFT个块号
+#define PTRS_BLOCK ((ssize_t)1 << PTR_SHIFT)
+#define TBLOCK (BLOCKS_INODE + PTRS_BLOCK)          //从第TBLOCK个块开始使用二级索引
+#define MIN_BLOCK_SHIFT 12                          //block大小可选4KB到1MB
+#define MAX_BLOCK_SHIFT 20
+#define SUPER_SIZE 4096                             //superblock和inode位图占用的字节数，与block大小无关
 #define INODE_SIZE 512
 #define BLOCKNUM 32*1024
 #define INODENUM 1024
 #define MAX_FILENAME 256
+#define DENTNUM (4 * INODENUM)                      //目录项数目，硬链接使目录项可以多于inode
+#define RECLAIM_BATCH 256
+#define GROUP_BLOCKS 4096                           //每个块组的block数目
+#define GROUPNUM (BLOCKNUM / GROUP_BLOCKS)          //块组数目
+#define BITMAP_SIZE (BLOCKNUM / 8)                  //block位图占用的字节数
+#define PREFETCH_NUM 8                              //读到换出的块时，顺带异步读回后面的块数
+#define PREFETCH_RING 256
+#define STATS_PATH "/.oshfs_stats"                  //只读的虚拟文件，读出文件系统的统计信息
+#define STATS_SIZE 4096                             //统计信息的最大长度
+#define QUERY_PATH "/.oshfs_query"                  //虚拟目录，QUERY_PATH/PATTERN中只有名字与PATTERN匹配的文件
+#define CKPT_MAGIC "OSHFSCK3"                       //检查点文件头
+#define JOURNAL_MAGIC "OSHFSJN2"                    //日志文件头
+#define JOURNAL_FLUSH (1 << 20)                     //日志缓冲区积累到这么多字节就写出
+#define UR_DEPTH 128                                //每个io_uring的队列深度
+#define UR_CHUNK (256 * 1024)                       //检查点写出时每个注册缓冲区的大小
+#define UR_CHUNKS 16                                //检查点写出时最多同时在写的缓冲区数
+#define NAME_ALIGN 16                               //字符串池中文件名按16字节对齐分配
+#define NAME_CHUNK (64 * 1024)                      //字符串池每次向系统要的内存大小
+#define WC_SIZE (BLOCK_SIZE > 16384 ? BLOCK_SIZE : 16384)  //每个文件的写合并缓冲区大小，不小于一个块
+#define WC_SMALL 1024                               //小于这个大小的追加写先放进写合并缓冲区
+#define WC_DELAY 50                                 //缓冲区中的数据最多停留的毫秒数
+#define DEFRAG_BATCH 256                            //整理时每次持写锁最多搬动的块数
+#define DEFRAG_RUN 16                               //平均连续段短于这么多块的文件需要整理
+#define DEFRAG_IDLE 5                               //一轮没有可整理的文件时，隔多少秒再扫
+#define EBR_SLOTS 128                               //同时在读的线程数上限
+#define TIER_STRIPES 64                             //分层存储命中统计分散到的缓存行数
+#define CRC32C_POLY 0x82f63b78                      //CRC32C（Castagnoli）多项式的反射表示
+#define SUM_VALID (1ULL << 32)                      //block_sum中：低32位的CRC有效
+#define SUM_GEN (1ULL << 33)                        //block_sum中：再往上是块被改写的次数
+#define SUM_LOCKS 64                                //写块和更新校验和时按块号分段加锁
+#define SCRUB_BATCH 64                              //校验线程每校验这么多块按scrub_rate睡一次
+#define SCRUB_IDLE 5                                //校验线程扫完一遍后隔多少秒再扫
+#define XATTR_INLINE 64                             //inode中放扩展属性的字节数，加上块映射正好占满INODE_SIZE
+#define XATTR_ENT 3                                 //一条扩展属性记录的头：1字节名字长度，2字节值长度
+#define FAIR_TENANTS 64                             //分别排队和统计的uid数，再多的uid共用一个
+#define LAT_BUCKETS 160                             //延迟直方图的格子数，每个2的幂4格，最大约2^40ns
+#define BUILD_CHUNK (4 << 20)                       //离线构建镜像时每次读源文件的字节数
+#define BUILD_BATCH 256                             //离线构建时一次pwritev最多写的块记录数，iovec数不超过IOV_MAX
+#define FH_STREAM 0x1                               //fi->fh标志：direct_io打开，读写使用流式拷贝
+#define FH_INO_SHIFT 8                              //fi->fh的第8到31位存放打开的文件的inode号
+#define FH_INO_MASK 0xffffff
+#define FH_GEN_SHIFT 32                             //fi->fh的高32位存放打开时inode的代数
 
 //超级块SuperBlock起始地址为0,其结构如下
 typedef struct {
-	int blocksize;				//block大小	4KB
+	int blocksize;				//block大小，4KB到1MB
 	int inodesize;				//inode大小 512B
 	int sum_inodes;				//inode的总数
 	int free_inodes; 			//空闲inode的总数
@@ -37,7 +112,7 @@ struct filestate {
 //  dev_t     st_dev;         /* ID of device containing file */
     ino_t     st_ino;         /* inode number */
     mode_t    st_mode;        /* protection */
-//  nlink_t   st_nlink;       /* number of hard links */
+    nlink_t   st_nlink;       /* number of hard links */
     uid_t     st_uid;         /* user ID of owner */
     gid_t     st_gid;         /* group ID of owner */
 //  dev_t     st_rdev;        /* device ID (if special file) */
@@ -46,26 +121,909 @@ struct filestate {
     blkcnt_t  st_blocks;      /* number of blocks allocated */
 };
 
-//inode 存储，权限，文件大小，分配给的block块等
+//inode中的扩展属性：放得下的记录直接放在data中，其余的放在共享的扩展属性块中
+typedef struct {
+    uint32_t mask;                  //所有属性名哈希的位图，查不存在的属性时不用翻记录
+    int32_t  block;                 //扩展属性块号，0表示没有
+    uint16_t len;                   //data中已用的字节数
+    char     data[XATTR_INLINE];
+} xattr_head;
+
+//inode 存储分配给的block块等，只在读写和截断时用到
+//权限、文件大小等热属性在attr[]中，文件名在字符串池中
 typedef struct inode{
-    char filename[MAX_FILENAME];
     ssize_t  blnum[BLOCKS_INODE];
     ssize_t  bindirect;              //间接索引，把block号码放在一个新的block块中
     ssize_t  tindirect;              //二级间接索引
-    struct filestate *st;
-    struct inode *next;
+    int32_t  last_block;             //上一次分配到的block号，下一次从它后面找
+    struct filestate *st;            //指向attr[]中这个inode的属性
+    xattr_head xattr;                //扩展属性，占用inode剩下的空间
 }inode;
 
+//挂载参数，在main中由fuse_opt_parse解析，在init中交给内核
+static struct options {
+    unsigned max_write;         //单个写请求的最大字节数
+    unsigned max_readahead;     //内核预读的最大字节数
+    unsigned max_background;    //内核同时挂起的异步请求数
+    int nosplice;               //不使用splice在内核与进程间传数据
+    int kcache;                 //本进程是唯一的写者，允许内核缓存页面、目录项和属性
+    double cache_timeout;       //kcache模式下目录项和属性的缓存时间（秒）
+    int direct_io;              //所有文件都以direct_io打开
+    unsigned long long direct_io_threshold;     //不小于该大小的文件以direct_io打开，0表示不启用
+    char *spill;                //冷块换出到的文件，为NULL时所有块都在内存中
+    unsigned long long mem_budget;              //启用spill时内存中最多保留的块的字节数
+    char *checkpoint;           //检查点基础镜像的路径，增量保存为PATH.1、PATH.2……
+    unsigned checkpoint_interval;               //每隔多少秒做一次检查点，0表示只在收到SIGUSR1和卸载时做
+    unsigned checkpoint_deltas;                 //增量数达到该值时，下一次检查点合并为新的基础镜像
+    int journal;                //在检查点之间记录元数据日志PATH.journal
+    int journal_sync;           //每个修改操作返回前都等日志落盘
+    int uring;                  //spill文件、检查点和日志的读写通过io_uring批量提交
+    int nocoalesce;             //不合并小的追加写
+    unsigned blocksize;         //block大小，4KB到1MB之间的2的幂；已有检查点时以检查点中的为准
+    int defrag;                 //启动后台整理线程
+    unsigned defrag_rate;       //整理线程每秒最多搬动的块数
+    int checksum;               //整块写入时计算CRC32C校验和
+    unsigned verify;            //读时校验：0不校验，1读整块时校验，2读到块的任何部分都校验整块
+    unsigned scrub_rate;        //校验线程每秒最多校验的块数，0表示不启动校验线程
+    int fair;                   //按uid公平调度读写请求
+    unsigned fair_slots;        //同时执行的读写请求数，0表示CPU数
+    char *fair_weights;         //各uid的权重，如"1000:4,1001:1"，没有列出的为1
+    char *build;                //不挂载，把这个目录中的文件导入为checkpoint处的基础镜像
+    unsigned build_threads;     //导入时读源文件的线程数，0表示CPU数
+} options = {
+    .max_write = 1 << 20,
+    .max_readahead = 1 << 20,
+    .max_background = 64,
+    .cache_timeout = 3600.0,
+    .checkpoint_deltas = 16,
+    .defrag_rate = 16384,
+    .verify = 1,
+    .scrub_rate = 4096,
+};
+
+#define OSHFS_OPT(t, p) { t, offsetof(struct options, p), 1 }
+static const struct fuse_opt option_spec[] = {
+    OSHFS_OPT("max_write=%u", max_write),
+    OSHFS_OPT("max_readahead=%u", max_readahead),
+    OSHFS_OPT("max_background=%u", max_background),
+    OSHFS_OPT("nosplice", nosplice),
+    OSHFS_OPT("kcache", kcache),
+    OSHFS_OPT("cache_timeout=%lf", cache_timeout),
+    OSHFS_OPT("direct_io", direct_io),
+    OSHFS_OPT("direct_io_threshold=%llu", direct_io_threshold),
+    OSHFS_OPT("spill=%s", spill),
+    OSHFS_OPT("mem_budget=%llu", mem_budget),
+    OSHFS_OPT("checkpoint=%s", checkpoint),
+    OSHFS_OPT("checkpoint_interval=%u", checkpoint_interval),
+    OSHFS_OPT("checkpoint_deltas=%u", checkpoint_deltas),
+    OSHFS_OPT("journal", journal),
+    OSHFS_OPT("journal_sync", journal_sync),
+    OSHFS_OPT("uring", uring),
+    OSHFS_OPT("nocoalesce", nocoalesce),
+    OSHFS_OPT("blocksize=%u", blocksize),
+    OSHFS_OPT("defrag", defrag),
+    OSHFS_OPT("defrag_rate=%u", defrag_rate),
+    OSHFS_OPT("checksum", checksum),
+    OSHFS_OPT("verify=%u", verify),
+    OSHFS_OPT("scrub_rate=%u", scrub_rate),
+    OSHFS_OPT("fair", fair),
+    OSHFS_OPT("fair_slots=%u", fair_slots),
+    OSHFS_OPT("fair_weights=%s", fair_weights),
+    OSHFS_OPT("build=%s", build),
+    OSHFS_OPT("build_threads=%u", build_threads),
+    FUSE_OPT_END
+};
+
+//block大小为1<<blk_shift，挂载后不再改变
+//块号、块内偏移和索引块中的位置都用移位和掩码计算，不做除法
+static int blk_shift = 12;
+
 //node数组指向inode的地址 mem数组指向block的地址
 static void *node[INODENUM];
 static void *mem[BLOCKNUM];
 static inode *root;
+
+//按inode号排列的热属性，以及按目录项号排列的文件名，getattr和readdir只需线性扫描这几个数组
+//一个inode可以有多个目录项（硬链接），st_nlink为指向它的目录项数
+static struct filestate attr[INODENUM];
+static uint32_t inode_gen[INODENUM];    //inode号每回收一次加1，打开的文件据此发现inode号已分给别的文件
+static int32_t dent_ino[DENTNUM];       //目录项指向的inode号，0表示目录项空闲
+static char *name_ptr[DENTNUM];         //文件名在字符串池中的位置
+static uint16_t name_len[DENTNUM];
+static uint32_t name_hash[DENTNUM];     //文件名的哈希，0表示这个目录项上没有文件
+//按文件名排序的目录项号，按前缀查找时二分；和字符串池一起在name_lock下修改
+static uint16_t name_order[DENTNUM];
+static int name_count;
+//字符串池：按NAME_ALIGN的倍数分配，释放的槽按大小挂到空闲链表上重用
+static char *name_free[MAX_FILENAME / NAME_ALIGN + 1];
+static char *name_pool;
+static size_t name_pool_left;
+static pthread_mutex_t name_lock = PTHREAD_MUTEX_INITIALIZER;
+//创建、链接、删除和改名先查找目录项再修改，dir_lock使它们之间互斥
+static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//写合并缓冲区：文件末尾的小追加写先攒在这里，攒到块边界再一次写进块中
+//缓冲区中的数据不计入st_size，getattr和readdir报告的大小要加上它
+typedef struct wcbuf {
+    pthread_mutex_t lock;
+    off_t off;                  //缓冲区第一个字节在文件中的位置
+    size_t len;                 //缓冲区中的字节数
+    size_t cap;                 //写到块边界为止缓冲区能放的字节数
+    long long first;            //缓冲区从空变为非空的时间（毫秒）
+    int error;                  //写回失败的错误码，由下一次fsync报告
+    char data[];                //WC_SIZE字节，随结构体一起分配
+} wcbuf;
+
+static wcbuf *wcb[INODENUM];            //按inode号，第一次小追加写时分配
+
+
+//文件大小，包括写合并缓冲区中还没写进块的部分
+static off_t file_size(int ino)
+{
+    wcbuf *w = wcb[ino];
+    off_t size = attr[ino].st_size;
+
+    if(w && w->len > 0 && w->off + (off_t)w->len > size)
+        size = w->off + w->len;
+    return size;
+}
+
+
+//文件删除时丢掉缓冲区中的数据
+static void wc_drop(int ino)
+{
+    wcbuf *w = wcb[ino];
+
+    if(w == NULL)
+        return;
+    pthread_mutex_lock(&w->lock);
+    w->len = 0;
+    w->error = 0;
+    pthread_mutex_unlock(&w->lock);
+}
 static SuperBlock *super;
 
 int32_t *inode_bitmap;	    //inode bitmap inode位图
 
 int32_t *block_bitmap;		//block bitmap block位图
 
+static uint64_t *block_sum;     //每个块的校验和，未启用checksum时为NULL
+
+//回收队列中的一项：unlink或截断时从inode上摘下来的块
+//level为0表示数据块，1表示一级索引块（其中的块号都是数据块），2表示二级索引块
+typedef struct reclaim {
+    struct {
+        int32_t nr;
+        int32_t level;
+    } *ent;
+    int n;
+    int cap;
+    struct reclaim *next;
+}reclaim;
+
+//块组：仿照ext2把block空间分成若干组，每组有自己的一段位图、空闲块数和锁
+//文件优先在自己inode所在的组里分配，组满了再溢出到相邻的组
+typedef struct {
+    pthread_mutex_t lock;
+    int32_t *bitmap;            //指向block_bitmap中属于本组的一段
+    int free;                   //本组空闲块数
+    int first;                  //本组第一个block号
+} __attribute__((aligned(64))) group;
+
+static group groups[GROUPNUM];
+
+//reclaim_lock保护回收队列
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;     //回收队列非空
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;       //有块被回收
+static reclaim *reclaim_head;
+static reclaim *reclaim_tail;
+static int reclaim_busy;                //正在被释放、尚未还给位图的回收项数目
+
+//io_uring后端：每个线程一个环，第一次使用时建立
+//一批读写请求一次提交，由内核并发完成，再一次收割完成事件
+//user_data的高32位是调用者的标记，低32位是期望传输的字节数
+typedef struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head,*sq_tail,*sq_mask,*sq_array;
+    unsigned *cq_head,*cq_tail,*cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring,*cq_ring;     //映射的环，单次映射时cq_ring为NULL
+    size_t sq_size,cq_size,sqes_size;
+    unsigned to_submit;         //已填好还没提交的请求数
+    unsigned inflight;          //已提交还没完成的请求数
+    int error;                  //第一个失败的请求的错误码
+    int registered;             //是否已注册检查点缓冲区
+    int broken;                 //io_uring_enter出过不可恢复的错，本线程改用同步读写
+    void (*done)(struct uring *r,unsigned tag,int res);    //每个请求完成时调用
+} uring;
+
+static __thread uring *my_ring;
+static pthread_key_t ur_key;
+static pthread_once_t ur_once = PTHREAD_ONCE_INIT;
+static char *ur_arena;              //检查点写出用的缓冲区，注册给io_uring
+
+
+//拆掉一个环：解除映射并关闭fd，没映射成功的部分为MAP_FAILED
+static void ur_free(void *ring)
+{
+    uring *r = (uring *)ring;
+
+    if(r->sqes != MAP_FAILED)
+        munmap(r->sqes,r->sqes_size);
+    if(r->cq_ring != NULL && r->cq_ring != MAP_FAILED)
+        munmap(r->cq_ring,r->cq_size);
+    if(r->sq_ring != MAP_FAILED)
+        munmap(r->sq_ring,r->sq_size);
+    close(r->fd);
+    free(r);
+}
+
+
+static uring *ur_setup(unsigned depth)
+{
+    struct io_uring_params p;
+    char *sq,*cq;
+    uring *r;
+
+    memset(&p,0,sizeof(p));
+    r = (uring *)calloc(1,sizeof(uring));
+    r->fd = syscall(__NR_io_uring_setup,depth,&p);
+    if(r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sq_size = r->cq_size = r->sq_size > r->cq_size ? r->sq_size : r->cq_size;
+    sq = r->sq_ring = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        cq = sq;
+    else
+        cq = r->cq_ring = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+        ur_free(r);
+        return NULL;
+    }
+    r->entries = p.sq_entries;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return r;
+}
+
+
+static void ur_key_init()
+{
+    pthread_key_create(&ur_key,ur_free);
+}
+
+
+//取得本线程的环，未启用io_uring或建立失败时返回NULL，调用者改用同步读写
+//线程退出时由ur_key的析构函数拆掉它的环
+static uring *ur_get()
+{
+    if(!options.uring)
+        return NULL;
+    if(my_ring == NULL && (my_ring = ur_setup(UR_DEPTH)) != NULL) {
+        pthread_once(&ur_once,ur_key_init);
+        pthread_setspecific(ur_key,my_ring);
+    }
+    return my_ring && !my_ring->broken ? my_ring : NULL;
+}
+
+
+//收割所有已完成的请求
+static void ur_reap(uring *r)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head = *r->cq_head;
+    int res;
+
+    while(head != __atomic_load_n(r->cq_tail,__ATOMIC_ACQUIRE)) {
+        cqe = &r->cqes[head & *r->cq_mask];
+        res = cqe->res;
+        //读写的字节数不够也算失败
+        if(res >= 0 && (uint32_t)cqe->user_data != 0 && res != (int)(uint32_t)cqe->user_data)
+            res = -EIO;
+        if(res < 0 && r->error == 0)
+            r->error = res;
+        if(r->done)
+            r->done(r,cqe->user_data >> 32,res);
+        r->inflight--;
+        head++;
+    }
+    __atomic_store_n(r->cq_head,head,__ATOMIC_RELEASE);
+}
+
+
+//提交所有填好的请求，并等待至少wait_nr个请求完成
+static void ur_submit(uring *r,unsigned wait_nr)
+{
+    int ret;
+
+    if(wait_nr > r->inflight + r->to_submit)
+        wait_nr = r->inflight + r->to_submit;
+    do
+        ret = syscall(__NR_io_uring_enter,r->fd,r->to_submit,wait_nr,
+                      wait_nr ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+    while(ret < 0 && errno == EINTR);
+    if(ret > 0) {
+        r->to_submit -= ret;
+        r->inflight += ret;
+    }
+    else if(ret < 0 && errno != EAGAIN && errno != EBUSY) {
+        //环本身出了错（EBADF、EFAULT、ENOMEM等），重试也不会好：
+        //收回还没提交的请求，已提交的也不再等，调用者看到错误，之后本线程改用同步读写
+        if(r->error == 0)
+            r->error = -errno;
+        __atomic_store_n(r->sq_tail,*r->sq_tail - r->to_submit,__ATOMIC_RELEASE);
+        r->to_submit = 0;
+        r->inflight = 0;
+        r->broken = 1;
+        return;
+    }
+    ur_reap(r);
+}
+
+
+//填一个请求，队列满时先提交并等待一部分请求完成
+static struct io_uring_sqe *ur_sqe(uring *r,int op,int fd,const void *buf,unsigned len,off_t off,unsigned tag)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail;
+
+    while(r->inflight + r->to_submit >= r->entries)
+        ur_submit(r,1);
+    tail = *r->sq_tail;
+    sqe = &r->sqes[tail & *r->sq_mask];
+    memset(sqe,0,sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = ((uint64_t)tag << 32) | (op == IORING_OP_FSYNC ? 0 : len);
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    __atomic_store_n(r->sq_tail,tail + 1,__ATOMIC_RELEASE);
+    r->to_submit++;
+    return sqe;
+}
+
+
+//提交并等待所有请求完成，返回第一个失败的请求的错误码
+static int ur_wait(uring *r)
+{
+    int err;
+
+    while(r->inflight + r->to_submit > 0)
+        ur_submit(r,r->inflight + r->to_submit);
+    err = r->error;
+    r->error = 0;
+    return err;
+}
+
+
+//分层存储：内存中最多保留resident_budget个块，冷块由CLOCK算法换出到spill文件
+//第n块在spill文件中的位置就是n*BLOCK_SIZE；换出的块mem[n]为NULL，spilled[n]为1
+static int spill_fd = -1;
+static ssize_t resident_budget;
+static ssize_t resident;                        //当前在内存中的块数
+static unsigned char spilled[BLOCKNUM];
+static unsigned char referenced[BLOCKNUM];      //CLOCK的访问位
+static ssize_t clock_hand = 2;
+static ssize_t tier_evictions;                  //统计值，只由持有mem_lock写锁的换出者增加
+//命中和未命中数：每个线程加到自己分到的缓存行上，读统计文件时再加起来
+static struct tier_stripe {
+    ssize_t hits,misses;
+} __attribute__((aligned(64))) tier_stripes[TIER_STRIPES];
+static __thread struct tier_stripe *tier_me;
+static int tier_next;
+
+//写者访问或修改mem[]中的块时持有mem_lock读锁，换出和做检查点时持有写锁，
+//块不会在写的过程中被换出，检查点也不会看到做了一半的修改；读者不拿mem_lock，见ebr_enter
+//必须读锁优先（glibc的默认值）：malloc_block持有读锁时可能等待回收线程，
+//而回收线程也要拿读锁，写锁优先会在写者排队时死锁
+//fault_lock保证同一个块只被读回一次，并保护预读队列
+static pthread_rwlock_t mem_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int mem_locking;                         //启用spill或检查点时才需要加锁
+static pthread_mutex_t fault_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tier_cond = PTHREAD_COND_INITIALIZER;
+static int32_t prefetch_ring[PREFETCH_RING];
+static unsigned prefetch_head,prefetch_tail;
+
+//检查点的脏标记：上一次检查点之后被修改过的block、inode，以及superblock和位图
+//只在持有mem_lock读锁时置位，在持有写锁做检查点时清零
+static unsigned char block_dirty[BLOCKNUM];
+static unsigned char inode_dirty[INODENUM];
+static int meta_dirty;
+static int names_dirty;             //目录项有变化，下一次检查点写出全部目录项
+#define DIRTY_BLOCK(n) (block_dirty[n] = 1)
+#define DIRTY_INODE(i) (inode_dirty[i] = 1)
+#define DIRTY_META() (meta_dirty = 1)
+#define DIRTY_NAMES() (names_dirty = 1)
+
+//预写日志：两次检查点之间的元数据修改（分配索引块、映射块号、文件大小、创建和删除inode）
+//以紧凑的记录追加到PATH.journal中。检查点之后没有别的地方保存数据块，
+//所以写入的数据也随J_DATA记录一起写入日志
+//记录先放在内存缓冲区里，fsync时由一个线程把所有线程积累的记录一次写出并fdatasync（组提交）
+enum {
+    J_CREATE = 1,           //ino，后跟jcreate
+    J_UNLINK,               //删除ino的一个目录项，后跟文件名
+    J_INDEX,                //ino，a为1（一级索引）、2（二级索引）或3（二级索引中第b个槽），c为块号
+    J_MAP,                  //ino的第a个块映射到块号b
+    J_DATA,                 //块a中偏移b处写入c字节，后跟数据
+    J_SIZE,                 //ino的大小改为a
+    J_TRUNC,                //ino截断到大小a
+    J_RENAME,               //b为flags，后跟原文件名和新文件名
+    J_LINK,                 //给ino增加一个目录项，后跟文件名
+    J_MOVE,                 //整理：ino的第a个块从块号b搬到块号c
+    J_XATTR,                //ino的扩展属性改过，后跟inode中的xattr_head；块中的记录另以J_DATA写入
+};
+
+typedef struct {
+    int32_t type;
+    int32_t ino;
+    int64_t a;
+    int32_t b;
+    int32_t c;
+} jrec;
+
+typedef struct {
+    struct filestate st;
+    char filename[MAX_FILENAME];
+} jcreate;
+
+typedef struct {
+    char magic[8];
+    int32_t gen;            //日志接在第gen代基础镜像的第seq个增量之后
+    int32_t seq;
+    int32_t blocksize;
+} jheader;
+
+static int journal_fd = -1;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static char *jbuf;                  //还没写出的记录
+static size_t jlen,jcap;
+static uint64_t jlsn;               //已追加的记录的总字节数
+static uint64_t jdurable;           //已落盘的记录的总字节数
+static int jflushing;               //有线程正在写日志
+static off_t jfile_off;             //下一批记录写到日志文件的位置，只由正在写日志的线程修改
+static uint64_t jcommits,jsyncs;    //统计值：提交请求数和fdatasync次数
+static int journal_error;           //写日志失败过，之后的记录不能保证落盘，提交一直返回-EIO
+
+
+//把一批记录写出并fdatasync，直到lsn之前的记录都已落盘
+//同时等待的线程只由一个线程写，其余的等它写完；写失败时返回-EIO
+static int journal_commit(uint64_t lsn)
+{
+    char *buf;
+    size_t len;
+    uint64_t target;
+    uring *r;
+    int err;
+
+    if(journal_fd < 0)
+        return 0;
+    pthread_mutex_lock(&journal_lock);
+    jcommits++;
+    while(jdurable < lsn && !journal_error) {
+        if(jflushing) {
+            pthread_cond_wait(&journal_cond,&journal_lock);
+            continue;
+        }
+        //取走缓冲区中所有的记录，其他线程可以继续追加到新的缓冲区
+        jflushing = 1;
+        buf = jbuf;
+        len = jlen;
+        target = jlsn;
+        jbuf = NULL;
+        jlen = jcap = 0;
+        pthread_mutex_unlock(&journal_lock);
+
+        err = 0;
+        if((r = ur_get()) != NULL) {
+            //写和fdatasync链在一起，一次系统调用提交
+            if(len > 0)
+                ur_sqe(r,IORING_OP_WRITE,journal_fd,buf,len,jfile_off,0)->flags |= IOSQE_IO_LINK;
+            ur_sqe(r,IORING_OP_FSYNC,journal_fd,NULL,0,0,0)->fsync_flags = IORING_FSYNC_DATASYNC;
+            if((err = ur_wait(r)) < 0) {
+                errno = -err;
+                err = -EIO;
+            }
+        }
+        else if((len > 0 && pwrite(journal_fd,buf,len,jfile_off) != (ssize_t)len) || fdatasync(journal_fd) != 0)
+            err = -EIO;
+        if(err < 0)
+            perror("journal");
+        jfile_off += len;
+        free(buf);
+
+        pthread_mutex_lock(&journal_lock);
+        jsyncs++;
+        if(err < 0)
+            journal_error = err;
+        else
+            jdurable = target;
+        jflushing = 0;
+        pthread_cond_broadcast(&journal_cond);
+    }
+    err = journal_error;
+    pthread_mutex_unlock(&journal_lock);
+    return err;
+}
+
+
+//追加一条记录，返回追加之后的lsn
+static uint64_t journal_append(int type,int ino,int64_t a,int32_t b,int32_t c,const void *data,size_t len)
+{
+    jrec r;
+    uint64_t lsn;
+    int flush;
+
+    if(journal_fd < 0)
+        return 0;
+    r.type = type;
+    r.ino = ino;
+    r.a = a;
+    r.b = b;
+    r.c = c;
+    pthread_mutex_lock(&journal_lock);
+    if(jlen + sizeof(r) + len > jcap) {
+        jcap = (jlen + sizeof(r) + len) * 2;
+        jbuf = realloc(jbuf,jcap);
+    }
+    memcpy(jbuf + jlen,&r,sizeof(r));
+    if(len > 0)
+        memcpy(jbuf + jlen + sizeof(r),data,len);
+    jlen += sizeof(r) + len;
+    jlsn += sizeof(r) + len;
+    lsn = jlsn;
+    flush = jlen >= JOURNAL_FLUSH && !jflushing;
+    pthread_mutex_unlock(&journal_lock);
+    if(flush)
+        journal_commit(lsn);
+    return lsn;
+}
+
+
+//journal_sync模式下，修改操作返回前等待日志落盘，日志写失败时返回-EIO
+static int journal_done()
+{
+    if(journal_fd >= 0 && options.journal_sync)
+        return journal_commit(jlsn);
+    return 0;
+}
+
+
+//读者不加锁：进入时把全局epoch记在自己独占的缓存行里，离开时清零
+//要munmap的块、索引块和inode先从块映射上摘下来，ebr_sync等进入得更早的读者都离开之后才释放，
+//读者手里的指针因此一直有效
+static struct ebr_slot {
+    uint64_t epoch;             //读者进入时的epoch，0表示不在读
+    int used;                   //槽已分给某个线程
+} __attribute__((aligned(64))) ebr_slots[EBR_SLOTS];
+static uint64_t ebr_epoch = 1;
+static __thread struct ebr_slot *ebr_me;
+static pthread_key_t ebr_key;
+static pthread_once_t ebr_once = PTHREAD_ONCE_INIT;
+
+//线程退出时把槽还回去
+static void ebr_release(void *slot)
+{
+    __atomic_store_n(&((struct ebr_slot *)slot)->used,0,__ATOMIC_RELEASE);
+}
+
+
+static void ebr_key_init()
+{
+    pthread_key_create(&ebr_key,ebr_release);
+}
+
+
+static void ebr_enter()
+{
+    int i;
+
+    while(ebr_me == NULL) {
+        pthread_once(&ebr_once,ebr_key_init);
+        for(i = 0;i < EBR_SLOTS && ebr_me == NULL;i++)
+            if(__sync_bool_compare_and_swap(&ebr_slots[i].used,0,1))
+                ebr_me = &ebr_slots[i];
+        if(ebr_me == NULL)
+            sched_yield();
+        else
+            pthread_setspecific(ebr_key,ebr_me);
+    }
+    __atomic_store_n(&ebr_me->epoch,__atomic_load_n(&ebr_epoch,__ATOMIC_RELAXED),__ATOMIC_RELAXED);
+    //这次store必须在之后读块映射之前被回收者看到
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+static void ebr_exit()
+{
+    __atomic_store_n(&ebr_me->epoch,0,__ATOMIC_RELEASE);
+}
+
+
+//等待调用之前进入的读者都离开，之后释放已摘下的内存就不会有人在用
+//调用者不能在读者的epoch中，也不能持有读者会等待的锁（fault_lock）
+static void ebr_sync()
+{
+    uint64_t e,v;
+    int i;
+
+    e = __atomic_add_fetch(&ebr_epoch,1,__ATOMIC_SEQ_CST);
+    for(i = 0;i < EBR_SLOTS;i++)
+        while((v = __atomic_load_n(&ebr_slots[i].epoch,__ATOMIC_ACQUIRE)) != 0 && v < e)
+            sched_yield();
+}
+
+
+//块映射的序号：截断、删除和整理改块映射前后各加一，奇数表示正在修改
+//读者读之前和之后各看一次，序号变了就重读；只追加新块的写不改序号
+static unsigned map_seq[INODENUM];
+static pthread_mutex_t map_seq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void map_write_begin(int ino)
+{
+    pthread_mutex_lock(&map_seq_lock);
+    __atomic_store_n(&map_seq[ino],map_seq[ino] + 1,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+static void map_write_end(int ino)
+{
+    __atomic_store_n(&map_seq[ino],map_seq[ino] + 1,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&map_seq_lock);
+}
+
+
+static unsigned map_read_begin(int ino)
+{
+    unsigned seq;
+
+    while((seq = __atomic_load_n(&map_seq[ino],__ATOMIC_ACQUIRE)) & 1)
+        sched_yield();
+    return seq;
+}
+
+
+static int map_read_retry(int ino,unsigned seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&map_seq[ino],__ATOMIC_RELAXED) != seq;
+}
+
+
+static void mem_rdlock()
+{
+    if(mem_locking)
+        pthread_rwlock_rdlock(&mem_lock);
+}
+
+
+static void mem_unlock()
+{
+    if(mem_locking)
+        pthread_rwlock_unlock(&mem_lock);
+}
+
+
+//把换出的块n读回内存，调用者持有mem_lock读锁或者在读者的epoch中
+static char *fault_in(ssize_t n)
+{
+    char *p;
+
+    pthread_mutex_lock(&fault_lock);
+    p = mem[n];
+    if(p == NULL && spilled[n]) {
+        p = mmap(NULL, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED || pread(spill_fd,p,BLOCK_SIZE,(off_t)n * BLOCK_SIZE) != BLOCK_SIZE) {
+            if(p != MAP_FAILED)
+                munmap(p,BLOCK_SIZE);
+            pthread_mutex_unlock(&fault_lock);
+            return NULL;
+        }
+        spilled[n] = 0;
+        __atomic_store_n(&mem[n],p,__ATOMIC_RELEASE);
+        if(__sync_add_and_fetch(&resident,1) > resident_budget)
+            pthread_cond_signal(&tier_cond);
+    }
+    pthread_mutex_unlock(&fault_lock);
+    return p;
+}
+
+
+//取得第n块的地址，换出的块先读回内存
+static inline char *blk(ssize_t n)
+{
+    char *p;
+
+    if(spill_fd < 0)
+        return mem[n];
+    //已经置位时不再写，读热块的线程不会反复弄脏同一条缓存行
+    if(!__atomic_load_n(&referenced[n],__ATOMIC_RELAXED))
+        __atomic_store_n(&referenced[n],1,__ATOMIC_RELAXED);
+    if(tier_me == NULL)
+        tier_me = &tier_stripes[__sync_fetch_and_add(&tier_next,1) % TIER_STRIPES];
+    if((p = __atomic_load_n(&mem[n],__ATOMIC_ACQUIRE)) != NULL) {
+        __atomic_fetch_add(&tier_me->hits,1,__ATOMIC_RELAXED);
+        return p;
+    }
+    __atomic_fetch_add(&tier_me->misses,1,__ATOMIC_RELAXED);
+    return fault_in(n);
+}
+
+
+//新分配的块计入内存中的块数，超出预算时唤醒换出线程
+static void tier_account(ssize_t n)
+{
+    if(spill_fd < 0)
+        return;
+    __atomic_store_n(&referenced[n],1,__ATOMIC_RELAXED);
+    if(__sync_add_and_fetch(&resident,1) > resident_budget)
+        pthread_cond_signal(&tier_cond);
+}
+
+
+//CLOCK：转动指针，清掉最近访问过的块的访问位，
+//把其余的块写到spill文件后释放内存，直到内存中的块数降到target
+//调用者持有mem_lock写锁
+static void evict_blocks(ssize_t target)
+{
+    ssize_t n,scanned,pass;
+    int32_t victim[UR_DEPTH];
+    void *old[UR_DEPTH];
+    int i,cnt;
+    uring *r = ur_get();
+
+    for(scanned = 0;resident > target && scanned < 2 * BLOCKNUM;) {
+        //挑出一批要换出的块，一批之内指针最多转一圈，同一个块不会被挑两次
+        for(cnt = 0,pass = 0;cnt < UR_DEPTH && resident - cnt > target && pass < BLOCKNUM - 2;scanned++,pass++) {
+            n = clock_hand;
+            clock_hand = clock_hand + 1 < BLOCKNUM ? clock_hand + 1 : 2;
+            if(mem[n] == NULL)
+                continue;
+            if(__atomic_load_n(&referenced[n],__ATOMIC_RELAXED)) {
+                __atomic_store_n(&referenced[n],0,__ATOMIC_RELAXED);
+                continue;
+            }
+            victim[cnt++] = n;
+        }
+        //io_uring一次提交整批写，否则逐个pwrite；写失败的块留在内存中
+        if(r) {
+            for(i = 0;i < cnt;i++)
+                ur_sqe(r,IORING_OP_WRITE,spill_fd,mem[victim[i]],BLOCK_SIZE,(off_t)victim[i] * BLOCK_SIZE,0);
+            if(ur_wait(r) < 0)
+                cnt = 0;
+        }
+        else
+            for(i = 0;i < cnt;i++)
+                if(pwrite(spill_fd,mem[victim[i]],BLOCK_SIZE,(off_t)victim[i] * BLOCK_SIZE) != BLOCK_SIZE)
+                    victim[i] = 0;
+        //不加锁的读者可能正拿着这些块的地址：先在fault_lock下改成换出状态，
+        //之后再来的读者会从spill文件读回，等已经拿到地址的读者离开后再munmap
+        pthread_mutex_lock(&fault_lock);
+        for(i = 0;i < cnt;i++) {
+            if((n = victim[i]) == 0)
+                continue;
+            spilled[n] = 1;
+            old[i] = mem[n];
+            __atomic_store_n(&mem[n],NULL,__ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&fault_lock);
+        ebr_sync();
+        for(i = 0;i < cnt;i++) {
+            if(victim[i] == 0)
+                continue;
+            munmap(old[i],BLOCK_SIZE);
+            __sync_sub_and_fetch(&resident,1);
+            __atomic_fetch_add(&tier_evictions,1,__ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+//把一批换出的块读回内存，io_uring可用时一次提交所有读请求
+//调用者持有mem_lock读锁
+static void fault_in_batch(int32_t *nr,int cnt)
+{
+    char *buf[PREFETCH_RING];
+    int32_t want[PREFETCH_RING];
+    int i,k = 0;
+    uring *r = ur_get();
+
+    if(r == NULL) {
+        for(i = 0;i < cnt;i++)
+            if(mem[nr[i]] == NULL)
+                fault_in(nr[i]);
+        return;
+    }
+    pthread_mutex_lock(&fault_lock);
+    for(i = 0;i < cnt;i++) {
+        if(mem[nr[i]] != NULL || !spilled[nr[i]])
+            continue;
+        buf[k] = mmap(NULL, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(buf[k] == MAP_FAILED)
+            break;
+        //批里可能有重复的块，先清掉标记，第二次就会被跳过
+        want[k] = nr[i];
+        spilled[nr[i]] = 0;
+        ur_sqe(r,IORING_OP_READ,spill_fd,buf[k],BLOCK_SIZE,(off_t)nr[i] * BLOCK_SIZE,0);
+        k++;
+    }
+    if(ur_wait(r) < 0) {
+        for(i = 0;i < k;i++) {
+            munmap(buf[i],BLOCK_SIZE);
+            spilled[want[i]] = 1;
+        }
+        k = 0;
+    }
+    for(i = 0;i < k;i++) {
+        __atomic_store_n(&mem[want[i]],buf[i],__ATOMIC_RELEASE);
+        __sync_add_and_fetch(&resident,1);
+    }
+    pthread_mutex_unlock(&fault_lock);
+}
+
+
+//换出线程：内存中的块超出预算时换出冷块，并处理预读队列
+static void *tier_worker(void *arg)
+{
+    int32_t batch[PREFETCH_RING];
+    int cnt;
+
+    for(;;) {
+        pthread_mutex_lock(&fault_lock);
+        while(resident <= resident_budget && prefetch_head == prefetch_tail)
+            pthread_cond_wait(&tier_cond,&fault_lock);
+        for(cnt = 0;prefetch_head != prefetch_tail;cnt++)
+            batch[cnt] = prefetch_ring[prefetch_head++ % PREFETCH_RING];
+        pthread_mutex_unlock(&fault_lock);
+
+        if(cnt > 0) {
+            pthread_rwlock_rdlock(&mem_lock);
+            fault_in_batch(batch,cnt);
+            pthread_rwlock_unlock(&mem_lock);
+        }
+        if(resident > resident_budget) {
+            //多换出一些，避免每分配一个块就换出一次
+            pthread_rwlock_wrlock(&mem_lock);
+            evict_blocks(resident_budget - resident_budget / 16);
+            pthread_rwlock_unlock(&mem_lock);
+        }
+    }
+    return NULL;
+}
+
+
+//把块号加入预读队列，由换出线程异步读回内存
+static void prefetch_add(int32_t *nr,int cnt)
+{
+    int i;
+
+    pthread_mutex_lock(&fault_lock);
+    for(i = 0;i < cnt;i++)
+        if(prefetch_tail - prefetch_head < PREFETCH_RING)
+            prefetch_ring[prefetch_tail++ % PREFETCH_RING] = nr[i];
+    pthread_cond_signal(&tier_cond);
+    pthread_mutex_unlock(&fault_lock);
+}
+
 
 //给出第j个block，找到第j个block的号码
 ssize_t lookforblnum(inode *node,ssize_t j,int32_t **add)
@@ -75,535 +1033,4033 @@ ssize_t lookforblnum(inode *node,ssize_t j,int32_t **add)
 
     if(j < BLOCKS_INODE) {
         n = node->blnum[j];
-        *add = &(node->blnum[j]);
+        *add = (int32_t *)&(node->blnum[j]);
     }
     else if(j < TBLOCK) {
-        p = (int32_t *)mem[node->bindirect];
+        //索引块还未分配时，第j个块必然也未分配
+        if(node->bindirect == 0) {
+            *add = NULL;
+            return 0;
+        }
+        p = (int32_t *)blk(node->bindirect);
         n = *(p + j - BLOCKS_INODE);
         *add = p + j -BLOCKS_INODE;
     }
     else {
         int a,b;
-        p = (int32_t *)mem[node->tindirect];
-        a = (j - TBLOCK) / (BLOCK_SIZE / 4);
-        b = (j - TBLOCK) % (BLOCK_SIZE / 4);
-        q = (int32_t *)mem[*(p + a)];
-        printf("*q = %d\t",*(q+b));
+        if(node->tindirect == 0) {
+            *add = NULL;
+            return 0;
+        }
+        p = (int32_t *)blk(node->tindirect);
+        a = (j - TBLOCK) >> PTR_SHIFT;
+        b = (j - TBLOCK) & (PTRS_BLOCK - 1);
+        if(*(p + a) == 0) {
+            *add = NULL;
+            return 0;
+        }
+        q = (int32_t *)blk(*(p + a));
         n = *(q + b);
         *add = q + b;
     }
-    return n;
+    return n;
+}
+
+
+//分配inode给文件
+static int malloc_inode()
+{
+    int j = 0,i = 0;
+    int find = 0;
+
+    if(super->free_inodes <= 0)
+        return -ENOSPC;
+
+    while(i < INODENUM / 32) {
+            //若bitmap中已经被分配，则询问下一个inode是否被分配
+            // == -1即意味着32位全为1 
+        j = 0;
+        if(inode_bitmap[i] == -1) {
+            i++;
+            continue;
+        }
+        else
+            while(j < 32) {
+            if((inode_bitmap[i] >> j) % 2 ==0) {
+            //移位操作 判断该位是否为0 若未分配（为0）那么返回inode号码
+                find = 1;
+                break;
+            }
+            j++;
+            }
+        if(find == 1)
+            break;
+        i++;
+    }
+    super->free_inodes--;
+    inode_bitmap[i] += (1 << j);
+    DIRTY_META();
+    node[i*32+j] = mmap(NULL, INODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return i*32+j;
+} 
+
+
+//块校验和：CRC32C，CPU支持SSE4.2时用crc32指令
+//一个块分成三段同时算，三条crc32指令的延迟互相重叠，最后在GF(2)上把三段的CRC拼起来
+static uint32_t crc_table[256];
+static uint32_t crc_x2n[32];                //x^(2^k) mod P
+static size_t crc_lane;                     //前两段的长度，第三段是剩下的部分
+static uint32_t crc_lane_k,crc_last_k;      //CRC往后移过一段、移过第三段时所乘的因子
+static int crc_hw;                          //CPU支持crc32指令
+static pthread_mutex_t sum_lock[SUM_LOCKS];
+static ssize_t sum_errors,scrub_blocks,scrub_passes;   //统计值：校验失败的次数，校验线程校验过的块数和遍数
+
+//a*b mod P，与zlib的crc32_combine用的方法相同
+static uint32_t crc_mul(uint32_t a,uint32_t b)
+{
+    uint32_t m = 1u << 31,p = 0;
+
+    for(;;) {
+        if(a & m) {
+            p ^= b;
+            if((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+
+//x^(8*len) mod P：A后面接上len字节的B时，crc(AB) = crc(A)*x^(8*len) ^ crc(B)
+static uint32_t crc_shift(size_t len)
+{
+    uint32_t p = 1u << 31;
+    int k = 3;
+
+    for(;len != 0;len >>= 1,k++)
+        if(len & 1)
+            p = crc_mul(crc_x2n[k & 31],p);
+    return p;
+}
+
+
+//查表用的余数表和拼接用的因子都与block大小有关，定下block大小之后再算
+static void crc_init()
+{
+    uint32_t c;
+    int i,k;
+
+    for(i = 0;i < 256;i++) {
+        c = i;
+        for(k = 0;k < 8;k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[i] = c;
+    }
+    crc_x2n[0] = 1u << 30;
+    for(k = 1;k < 32;k++)
+        crc_x2n[k] = crc_mul(crc_x2n[k - 1],crc_x2n[k - 1]);
+    crc_lane = (BLOCK_SIZE / 3) & ~(size_t)7;
+    crc_lane_k = crc_shift(crc_lane);
+    crc_last_k = crc_shift(BLOCK_SIZE - 2 * crc_lane);
+#ifdef __x86_64__
+    crc_hw = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+
+
+static uint32_t crc32c_sw(const char *p,size_t len)
+{
+    uint32_t c = ~0u;
+
+    while(len-- > 0)
+        c = crc_table[(c ^ (unsigned char)*p++) & 0xff] ^ (c >> 8);
+    return ~c;
+}
+
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(const char *p)
+{
+    uint64_t a = ~0u,b = ~0u,c = ~0u,x,y,z;
+    const char *q = p + crc_lane,*r = p + 2 * crc_lane,*end = p + BLOCK_SIZE;
+    size_t i;
+
+    //用户的缓冲区不一定按8字节对齐，memcpy会被编译成一条普通的load
+    for(i = 0;i < crc_lane;i += 8) {
+        memcpy(&x,p + i,8);
+        memcpy(&y,q + i,8);
+        memcpy(&z,r + i,8);
+        a = _mm_crc32_u64(a,x);
+        b = _mm_crc32_u64(b,y);
+        c = _mm_crc32_u64(c,z);
+    }
+    for(r += i;r < end;r += 8) {
+        memcpy(&z,r,8);
+        c = _mm_crc32_u64(c,z);
+    }
+    return crc_mul(crc_last_k,crc_mul(crc_lane_k,~(uint32_t)a) ^ ~(uint32_t)b) ^ ~(uint32_t)c;
+}
+#endif
+
+
+//一整块的CRC32C
+static uint32_t crc32c_block(const char *p)
+{
+#ifdef __x86_64__
+    if(crc_hw)
+        return crc32c_hw(p);
+#endif
+    return crc32c_sw(p,BLOCK_SIZE);
+}
+
+
+//改写第n块的校验和，同时把修改次数加一；v为0表示作废
+//调用者持有这个块的sum_lock，或者没有别人会写这个块
+static void sum_store(ssize_t n,uint64_t v)
+{
+    __atomic_store_n(&block_sum[n],((block_sum[n] | (SUM_GEN - 1)) + 1) | v,__ATOMIC_RELEASE);
+}
+
+
+//写第n块之前：加锁并作废校验和，读者不会拿写了一半的内容去比
+static void sum_begin(ssize_t n)
+{
+    pthread_mutex_lock(&sum_lock[n % SUM_LOCKS]);
+    if(block_sum[n] & SUM_VALID)
+        sum_store(n,0);
+    //作废必须在改块的内容之前被读者看到
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+//写完第n块：整块写入时记下新内容data的CRC，部分写入时校验和保持作废
+static void sum_end(ssize_t n,const char *data)
+{
+    if(data != NULL)
+        sum_store(n,SUM_VALID | crc32c_block(data));
+    pthread_mutex_unlock(&sum_lock[n % SUM_LOCKS]);
+}
+
+
+//校验地址为p的第n块，内容与校验和不符时返回-1
+//没有有效的校验和，或者校验期间块被改写、挪走时不算错
+static int sum_check(ssize_t n,const char *p)
+{
+    uint64_t s = __atomic_load_n(&block_sum[n],__ATOMIC_ACQUIRE);
+    uint32_t c;
+
+    if(!(s & SUM_VALID))
+        return 0;
+    c = crc32c_block(p);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(c == (uint32_t)s || __atomic_load_n(&block_sum[n],__ATOMIC_RELAXED) != s)
+        return 0;
+    __sync_add_and_fetch(&sum_errors,1);
+    fprintf(stderr,"block %zd: checksum mismatch (stored %08x, computed %08x)\n",n,(uint32_t)s,c);
+    return -1;
+}
+
+
+//后台校验：按scrub_rate轮流校验内存中有校验和的块，换出的块不读回来
+//经常读的块由读请求按verify校验，这里找的是长期没人读的块中的错误
+static void *scrub_worker(void *arg)
+{
+    ssize_t n,k = 0;
+    char *p;
+
+    for(;;) {
+        for(n = 2;n < BLOCKNUM;n++) {
+            if(!(__atomic_load_n(&block_sum[n],__ATOMIC_RELAXED) & SUM_VALID))
+                continue;
+            //在读者的epoch中，块不会在校验的时候被munmap
+            //要释放的块在ebr_sync之前作废了校验和，进入epoch之后再看一次
+            ebr_enter();
+            if((__atomic_load_n(&block_sum[n],__ATOMIC_ACQUIRE) & SUM_VALID) &&
+               (p = __atomic_load_n(&mem[n],__ATOMIC_ACQUIRE)) != NULL) {
+                sum_check(n,p);
+                scrub_blocks++;
+                k++;
+            }
+            ebr_exit();
+            if(k == SCRUB_BATCH) {
+                usleep(SCRUB_BATCH * 1000000ULL / options.scrub_rate);
+                k = 0;
+            }
+        }
+        scrub_passes++;
+        sleep(SCRUB_IDLE);
+    }
+    return NULL;
+}
+
+
+//把一批已经munmap的块还给所在块组的位图
+//同一组的连续几个块只加一次锁
+static void free_blocks(int32_t *nr,int cnt)
+{
+    int i,j,k;
+    group *g = NULL;
+
+    for(i = 0;i < cnt;i++) {
+        if(g != &groups[nr[i] / GROUP_BLOCKS]) {
+            if(g)
+                pthread_mutex_unlock(&g->lock);
+            g = &groups[nr[i] / GROUP_BLOCKS];
+            pthread_mutex_lock(&g->lock);
+        }
+        mem[nr[i]] = NULL;
+        if(block_sum)
+            sum_store(nr[i],0);
+        j = nr[i] / 32;
+        k = nr[i] % 32;
+        block_bitmap[j] -= (1 << k);
+        g->free++;
+    }
+    DIRTY_META();
+    if(g)
+        pthread_mutex_unlock(&g->lock);
+}
+
+
+//所有块组的空闲块数之和，顺便刷新super->free_blocknr
+static ssize_t count_free_blocks()
+{
+    int i;
+    ssize_t sum = 0;
+
+    for(i = 0;i < GROUPNUM;i++)
+        sum += groups[i].free;
+    super->free_blocknr = sum;
+    return sum;
+}
+
+
+//释放块n，若n是索引块则先释放它指向的块
+//攒够RECLAIM_BATCH个块再统一还给位图
+static void release_block(int32_t n,int level,int32_t *batch,int *cnt)
+{
+    int i;
+    int32_t *p;
+
+    if(n == 0)
+        return;
+    if(level > 0) {
+        p = (int32_t *)blk(n);
+        for(i = 0;p && i < PTRS_BLOCK;i++)
+            if(*(p + i) != 0)
+                release_block(*(p + i),level - 1,batch,cnt);
+    }
+    if(spill_fd >= 0) {
+        //换出的块不必读回，只需清掉标记
+        //预取线程可能正把它读回来，所以在fault_lock下再看mem[n]
+        pthread_mutex_lock(&fault_lock);
+        if(mem[n] != NULL) {
+            munmap(mem[n],BLOCK_SIZE);
+            __sync_sub_and_fetch(&resident,1);
+        }
+        spilled[n] = 0;
+        pthread_mutex_unlock(&fault_lock);
+    }
+    else if(mem[n] != NULL)
+        munmap(mem[n],BLOCK_SIZE);
+    else
+        return;
+    batch[(*cnt)++] = n;
+    if(*cnt == RECLAIM_BATCH) {
+        free_blocks(batch,*cnt);
+        *cnt = 0;
+    }
+}
+
+
+//作废第n块（若是索引块则是它指向的数据块）的校验和
+//校验线程按块号找块，不经过块映射，要靠校验和作废才知道块要被释放了
+static void sum_drop(int32_t n,int level)
+{
+    int i;
+    int32_t *p;
+
+    if(n == 0)
+        return;
+    if(level > 0) {
+        p = (int32_t *)blk(n);
+        for(i = 0;p && i < PTRS_BLOCK;i++)
+            sum_drop(*(p + i),level - 1);
+    }
+    else if(block_sum[n] & SUM_VALID)
+        sum_store(n,0);
+}
+
+
+//释放一个回收项中的所有块
+static void reclaim_release(reclaim *r)
+{
+    int32_t batch[RECLAIM_BATCH];
+    int i,cnt = 0;
+
+    if(block_sum)
+        for(i = 0;i < r->n;i++)
+            sum_drop(r->ent[i].nr,r->ent[i].level);
+    //这些块已经从块映射上摘下，等还在读它们的读者离开
+    ebr_sync();
+    for(i = 0;i < r->n;i++)
+        release_block(r->ent[i].nr,r->ent[i].level,batch,&cnt);
+    if(cnt > 0)
+        free_blocks(batch,cnt);
+    free(r->ent);
+    free(r);
+}
+
+
+//从回收队列中取出一项，调用者需持有reclaim_lock
+static reclaim *reclaim_pop()
+{
+    reclaim *r = reclaim_head;
+
+    if(r) {
+        reclaim_head = r->next;
+        if(reclaim_head == NULL)
+            reclaim_tail = NULL;
+        reclaim_busy++;
+    }
+    return r;
+}
+
+
+//后台回收线程：不断从队列中取出回收项并释放
+static void *reclaim_worker(void *arg)
+{
+    reclaim *r;
+
+    for(;;) {
+        pthread_mutex_lock(&reclaim_lock);
+        while(reclaim_head == NULL)
+            pthread_cond_wait(&reclaim_cond,&reclaim_lock);
+        r = reclaim_pop();
+        pthread_mutex_unlock(&reclaim_lock);
+
+        mem_rdlock();
+        reclaim_release(r);
+        mem_unlock();
+
+        pthread_mutex_lock(&reclaim_lock);
+        reclaim_busy--;
+        pthread_cond_broadcast(&space_cond);
+        pthread_mutex_unlock(&reclaim_lock);
+    }
+    return NULL;
+}
+
+
+static void reclaim_add(reclaim **r,int32_t nr,int level)
+{
+    if(nr == 0)
+        return;
+    if(*r == NULL)
+        *r = (reclaim *)calloc(1,sizeof(reclaim));
+    if((*r)->n == (*r)->cap) {
+        (*r)->cap = (*r)->cap ? (*r)->cap * 2 : 64;
+        (*r)->ent = realloc((*r)->ent,(*r)->cap * sizeof(*(*r)->ent));
+    }
+    (*r)->ent[(*r)->n].nr = nr;
+    (*r)->ent[(*r)->n].level = level;
+    (*r)->n++;
+}
+
+
+//把回收项挂到回收队列的末尾，唤醒回收线程
+static void reclaim_push(reclaim *r)
+{
+    if(r == NULL)
+        return;
+    pthread_mutex_lock(&reclaim_lock);
+    if(reclaim_tail)
+        reclaim_tail->next = r;
+    else
+        reclaim_head = r;
+    reclaim_tail = r;
+    pthread_cond_signal(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+
+//第n块下挂着的数据块数：level为0时n本身就是数据块，否则数索引块中的非空项
+static ssize_t mapped_blocks(int32_t n,int level)
+{
+    int32_t *p;
+    ssize_t i,cnt = 0;
+
+    if(n == 0)
+        return 0;
+    if(level == 0)
+        return 1;
+    p = (int32_t *)blk(n);
+    for(i = 0;p && i < PTRS_BLOCK;i++)
+        if(*(p + i) != 0)
+            cnt += mapped_blocks(*(p + i),level - 1);
+    return cnt;
+}
+
+
+//从第beg个块开始，把后面所有的块（以及不再需要的索引块）从inode上摘下来
+//挂到回收队列中由后台线程释放；返回摘下的数据块数，稀疏文件中它小于逻辑块数
+ssize_t trun(inode *node,ssize_t beg)
+{
+    ssize_t i,freed = 0;
+    int a,b;
+    int32_t *p;
+    reclaim *r = NULL;
+
+    DIRTY_INODE(node->st->st_ino);
+    for(i = beg;i < BLOCKS_INODE;i++) {
+        freed += node->blnum[i] != 0;
+        reclaim_add(&r,node->blnum[i],0);
+        node->blnum[i] = 0;
+    }
+
+    if(node->bindirect != 0) {
+        if(beg <= BLOCKS_INODE) {
+            //一级索引中的块全部要释放，连同索引块一起摘下
+            freed += mapped_blocks(node->bindirect,1);
+            reclaim_add(&r,node->bindirect,1);
+            node->bindirect = 0;
+        }
+        else if(beg < TBLOCK) {
+            p = (int32_t *)blk(node->bindirect);
+            DIRTY_BLOCK(node->bindirect);
+            for(i = beg - BLOCKS_INODE;i < PTRS_BLOCK;i++) {
+                freed += *(p + i) != 0;
+                reclaim_add(&r,*(p + i),0);
+                *(p + i) = 0;
+            }
+        }
+    }
+
+    if(node->tindirect != 0) {
+        if(beg <= TBLOCK) {
+            freed += mapped_blocks(node->tindirect,2);
+            reclaim_add(&r,node->tindirect,2);
+            node->tindirect = 0;
+        }
+        else {
+            p = (int32_t *)blk(node->tindirect);
+            DIRTY_BLOCK(node->tindirect);
+            a = (beg - TBLOCK) >> PTR_SHIFT;
+            b = (beg - TBLOCK) & (PTRS_BLOCK - 1);
+            if(b != 0) {
+                //第a个二级索引块只释放后半部分
+                if(*(p + a) != 0) {
+                    int32_t *q = (int32_t *)blk(*(p + a));
+                    DIRTY_BLOCK(*(p + a));
+                    for(i = b;i < PTRS_BLOCK;i++) {
+                        freed += *(q + i) != 0;
+                        reclaim_add(&r,*(q + i),0);
+                        *(q + i) = 0;
+                    }
+                }
+                a++;
+            }
+            for(;a < PTRS_BLOCK;a++) {
+                freed += mapped_blocks(*(p + a),1);
+                reclaim_add(&r,*(p + a),1);
+                *(p + a) = 0;
+            }
+        }
+    }
+
+    reclaim_push(r);
+    return freed;
+}
+
+
+//在块组g中从goal开始找一个空闲块，找到后在位图中置1
+//调用者需持有g->lock
+static int32_t group_find(group *g,int32_t goal)
+{
+    int i,j,k,w;
+
+    if(g->free <= 0)
+        return 0;
+    if(goal < g->first || goal >= g->first + GROUP_BLOCKS)
+        goal = g->first;
+    //从goal所在的字开始向后找，到组尾后再从组头找
+    w = (goal - g->first) / 32;
+    for(k = 0;k < GROUP_BLOCKS / 32;k++) {
+        i = (w + k) % (GROUP_BLOCKS / 32);
+        if(g->bitmap[i] == -1)
+            continue;
+        j = (k == 0) ? goal % 32 : 0;
+        for(;j < 32;j++)
+            if((g->bitmap[i] >> j) % 2 == 0) {
+                g->bitmap[i] += (1 << j);
+                g->free--;
+                return g->first + i*32 + j;
+            }
+    }
+    //goal所在的字中goal之前的位还没找过
+    i = w;
+    for(j = 0;j < goal % 32;j++)
+        if((g->bitmap[i] >> j) % 2 == 0) {
+            g->bitmap[i] += (1 << j);
+            g->free--;
+            return g->first + i*32 + j;
+        }
+    return 0;
+}
+
+
+//按inode所在的组、再向两边相邻的组依次找空闲块
+static int32_t groups_alloc(inode *node)
+{
+    int d,home;
+    int32_t n,goal;
+    group *g;
+
+    goal = node->last_block ? node->last_block + 1 : 0;
+    home = node->last_block ? node->last_block / GROUP_BLOCKS : node->st->st_ino % GROUPNUM;
+    for(d = 0;d < GROUPNUM;d++) {
+        //home, home+1, home-1, home+2, ...
+        int gi = (d % 2) ? home + (d + 1) / 2 : home - d / 2;
+        gi = (gi % GROUPNUM + GROUPNUM) % GROUPNUM;
+        g = &groups[gi];
+        if(g->free <= 0)
+            continue;
+        pthread_mutex_lock(&g->lock);
+        n = group_find(g,goal);
+        pthread_mutex_unlock(&g->lock);
+        if(n != 0)
+            return n;
+    }
+    return 0;
+}
+
+
+//分配一个block给文件inode中pointer空指针
+static ssize_t malloc_block(inode *node)
+{
+    int32_t n;
+    reclaim *r;
+
+    while((n = groups_alloc(node)) == 0) {
+        //空间不足时，帮忙释放回收队列中的块，或者等待回收线程释放完
+        pthread_mutex_lock(&reclaim_lock);
+        if((r = reclaim_pop()) != NULL) {
+            pthread_mutex_unlock(&reclaim_lock);
+            reclaim_release(r);
+            pthread_mutex_lock(&reclaim_lock);
+            reclaim_busy--;
+            pthread_cond_broadcast(&space_cond);
+        }
+        else if(reclaim_busy > 0)
+            pthread_cond_wait(&space_cond,&reclaim_lock);
+        else {
+            pthread_mutex_unlock(&reclaim_lock);
+            return -ENOSPC;
+        }
+        pthread_mutex_unlock(&reclaim_lock);
+    }
+
+    //给block分配内存
+    mem[n] = mmap(NULL, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem[n] == MAP_FAILED) {
+        mem[n] = NULL;
+        free_blocks(&n,1);
+        return -ENOSPC;
+    }
+    tier_account(n);
+    DIRTY_BLOCK(n);
+    DIRTY_META();
+    node->last_block = n;
+    node->st->st_blocks++;
+    return n;
+}
+
+
+static uint32_t name_hash_of(const char *name,size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for(i = 0;i < len;i++)
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h ? h : 1;
+}
+
+
+//目录项d的文件名与长为len的name按字节比较，一个是另一个的前缀时短的在前
+static int name_cmp(int d,const char *name,size_t len)
+{
+    size_t n = name_len[d] < len ? name_len[d] : len;
+    int c = memcmp(name_ptr[d],name,n);
+
+    return c ? c : (int)name_len[d] - (int)len;
+}
+
+
+//name_order中第一个文件名不小于name的位置，调用者持有name_lock
+static int name_lower(const char *name,size_t len)
+{
+    int lo = 0,hi = name_count,mid;
+
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(name_cmp(name_order[mid],name,len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
+//把目录项d的文件名放回字符串池
+static void name_clear(int d)
+{
+    int c,i;
+
+    if(name_hash[d] == 0)
+        return;
+    //先让查找看不到它，再释放槽
+    __atomic_store_n(&name_hash[d],0,__ATOMIC_RELEASE);
+    c = (name_len[d] + NAME_ALIGN) / NAME_ALIGN;
+    pthread_mutex_lock(&name_lock);
+    //改名时新旧名字可能暂时相同，要找到的是d自己
+    for(i = name_lower(name_ptr[d],name_len[d]);i < name_count && name_order[i] != d;i++)
+        ;
+    if(i < name_count) {
+        memmove(&name_order[i],&name_order[i + 1],(name_count - i - 1) * sizeof(name_order[0]));
+        name_count--;
+    }
+    *(char **)name_ptr[d] = name_free[c];
+    name_free[c] = name_ptr[d];
+    pthread_mutex_unlock(&name_lock);
+}
+
+
+//给目录项d设置文件名，名字从字符串池中分配
+static void name_set(int d,const char *name)
+{
+    size_t len = strnlen(name,MAX_FILENAME - 1);
+    int c = (len + NAME_ALIGN) / NAME_ALIGN,i;
+    char *p;
+
+    name_clear(d);
+    pthread_mutex_lock(&name_lock);
+    if((p = name_free[c]) != NULL)
+        name_free[c] = *(char **)p;
+    else {
+        if(name_pool_left < (size_t)c * NAME_ALIGN) {
+            name_pool = mmap(NULL, NAME_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            name_pool_left = NAME_CHUNK;
+        }
+        p = name_pool;
+        name_pool += c * NAME_ALIGN;
+        name_pool_left -= c * NAME_ALIGN;
+    }
+    memcpy(p,name,len);
+    p[len] = '\0';
+    name_ptr[d] = p;
+    name_len[d] = len;
+    i = name_lower(p,len);
+    memmove(&name_order[i + 1],&name_order[i],(name_count - i) * sizeof(name_order[0]));
+    name_order[i] = d;
+    name_count++;
+    pthread_mutex_unlock(&name_lock);
+    __atomic_store_n(&name_hash[d],name_hash_of(name,len),__ATOMIC_RELEASE);
+}
+
+
+//新建一个名为name、指向inode ino的目录项，返回目录项号，目录项用完时返回-ENOSPC
+static int dent_add(int ino,const char *name)
+{
+    static int hint = 1;
+    int i,d = -ENOSPC;
+
+    pthread_mutex_lock(&name_lock);
+    //从上一次分配的位置接着找空的目录项
+    for(i = 0;i < DENTNUM - 1;i++) {
+        if(dent_ino[hint] == 0) {
+            d = hint;
+            dent_ino[d] = ino;
+            break;
+        }
+        hint = hint + 1 < DENTNUM ? hint + 1 : 1;
+    }
+    pthread_mutex_unlock(&name_lock);
+    if(d > 0) {
+        name_set(d,name);
+        DIRTY_NAMES();
+    }
+    return d;
+}
+
+
+//删除目录项d，不改变inode的链接数
+static void dent_del(int d)
+{
+    name_clear(d);
+    pthread_mutex_lock(&name_lock);
+    dent_ino[d] = 0;
+    pthread_mutex_unlock(&name_lock);
+    DIRTY_NAMES();
+}
+
+
+//扩展属性：一条记录是XATTR_ENT字节的头加上名字（不带'\0'）和值
+//inode里放得下的记录放在inode中，其余的放进扩展属性块；内容相同的块只存一份，由多个inode共用
+//块的引用数只记在内存中，挂载时按inode重新数；扩展属性的修改都在dir_lock下进行
+typedef struct {
+    uint32_t hash;              //记录内容的哈希，找内容相同的块时先比它
+    uint32_t len;               //块头之后记录的总字节数
+} xattr_block;
+
+static struct {
+    int32_t nr;
+    int32_t refs;               //引用这个块的inode数
+} xattr_shared[INODENUM];       //所有扩展属性块
+static int xattr_nshared;
+static ssize_t xattr_fast;      //统计值：只看位图就返回ENODATA的次数
+
+
+static size_t xattr_ent_size(const char *e)
+{
+    return XATTR_ENT + (unsigned char)e[0] + ((unsigned char)e[1] | (unsigned char)e[2] << 8);
+}
+
+
+//名字为name的属性在inode位图中对应的位
+static uint32_t xattr_bit(const char *name,size_t nlen)
+{
+    return 1u << (name_hash_of(name,nlen) & 31);
+}
+
+
+//在len字节的记录中找名字为name的一条，找不到返回NULL
+static char *xattr_find(char *buf,size_t len,const char *name,size_t nlen)
+{
+    size_t off;
+
+    for(off = 0;off < len;off += xattr_ent_size(buf + off))
+        if((unsigned char)buf[off] == nlen && memcmp(buf + off + XATTR_ENT,name,nlen) == 0)
+            return buf + off;
+    return NULL;
+}
+
+
+//块号n在xattr_shared中的下标，没有时返回-1
+static int xattr_slot(int32_t n)
+{
+    int i;
+
+    for(i = 0;i < xattr_nshared;i++)
+        if(xattr_shared[i].nr == n)
+            return i;
+    return -1;
+}
+
+
+//记录与buf相同的扩展属性块在xattr_shared中的下标，没有时返回-1
+static int xattr_same(const char *buf,size_t len,uint32_t hash)
+{
+    xattr_block *h;
+    int i;
+
+    for(i = 0;i < xattr_nshared;i++) {
+        h = (xattr_block *)blk(xattr_shared[i].nr);
+        if(h != NULL && h->hash == hash && h->len == len && memcmp(h + 1,buf,len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+
+//inode p不再引用它的扩展属性块，最后一个引用去掉时把块交给回收线程
+static void xattr_unref(inode *p)
+{
+    reclaim *r = NULL;
+    int i;
+
+    if(p->xattr.block != 0 && (i = xattr_slot(p->xattr.block)) >= 0 && --xattr_shared[i].refs == 0) {
+        reclaim_add(&r,xattr_shared[i].nr,0);
+        reclaim_push(r);
+        xattr_shared[i] = xattr_shared[--xattr_nshared];
+    }
+    p->xattr.block = 0;
+}
+
+
+//取inode p的属性name，size为0时只返回值的长度
+static int xattr_get(inode *p,const char *name,char *value,size_t size)
+{
+    size_t nlen = strlen(name),vlen;
+    xattr_block *h;
+    char *e;
+
+    e = xattr_find(p->xattr.data,p->xattr.len,name,nlen);
+    if(e == NULL && p->xattr.block != 0 && (h = (xattr_block *)blk(p->xattr.block)) != NULL)
+        e = xattr_find((char *)(h + 1),h->len,name,nlen);
+    if(e == NULL)
+        return -ENODATA;
+    vlen = (unsigned char)e[1] | (unsigned char)e[2] << 8;
+    if(size == 0)
+        return vlen;
+    if(size < vlen)
+        return -ERANGE;
+    memcpy(value,e + XATTR_ENT + nlen,vlen);
+    return vlen;
+}
+
+
+//把len字节的记录中的名字依次写进list（以'\0'分隔），返回写了的长度，list为NULL时只计算长度
+static ssize_t xattr_names(const char *buf,size_t len,char *list,size_t size,size_t done)
+{
+    size_t off,nlen;
+
+    for(off = 0;off < len;off += xattr_ent_size(buf + off)) {
+        nlen = (unsigned char)buf[off];
+        if(list != NULL) {
+            if(done + nlen + 1 > size)
+                return -ERANGE;
+            memcpy(list + done,buf + off + XATTR_ENT,nlen);
+            list[done + nlen] = '\0';
+        }
+        done += nlen + 1;
+    }
+    return done;
+}
+
+
+//列出inode p的所有属性名，size为0时只返回需要的长度
+static int xattr_list(inode *p,char *list,size_t size)
+{
+    ssize_t n;
+    xattr_block *h;
+
+    if(size == 0)
+        list = NULL;
+    n = xattr_names(p->xattr.data,p->xattr.len,list,size,0);
+    if(n >= 0 && p->xattr.block != 0 && (h = (xattr_block *)blk(p->xattr.block)) != NULL)
+        n = xattr_names((char *)(h + 1),h->len,list,size,n);
+    return n;
+}
+
+
+//设置inode p的属性name，value为NULL时删除；flags为XATTR_CREATE或XATTR_REPLACE
+//所有记录重新排一遍：按顺序放得进inode的放进inode，其余的放进块，块的内容与已有的块相同时直接共用
+//调用者持有dir_lock和mem_lock读锁
+static int xattr_set(inode *p,const char *name,const char *value,size_t size,int flags)
+{
+    size_t nlen = strlen(name),len,ilen = 0,blen = 0,off,k;
+    char inl[XATTR_INLINE],*all,*bl,*e;
+    int32_t n = 0,old = p->xattr.block;
+    uint32_t mask = 0,hash;
+    xattr_block *h;
+    int i,ret = 0;
+
+    if(nlen == 0 || nlen > XATTR_NAME_MAX)
+        return -ERANGE;
+    if(value != NULL && size > 0xffff)
+        return -E2BIG;
+    all = malloc(2 * (XATTR_INLINE + BLOCK_SIZE + XATTR_ENT + nlen + size));
+    bl = all + XATTR_INLINE + BLOCK_SIZE + XATTR_ENT + nlen + size;
+    memcpy(all,p->xattr.data,p->xattr.len);
+    len = p->xattr.len;
+    if(old != 0 && (h = (xattr_block *)blk(old)) != NULL) {
+        memcpy(all + len,h + 1,h->len);
+        len += h->len;
+    }
+    e = xattr_find(all,len,name,nlen);
+    if(e != NULL && (flags & XATTR_CREATE))
+        ret = -EEXIST;
+    else if(e == NULL && (value == NULL || (flags & XATTR_REPLACE)))
+        ret = -ENODATA;
+    if(ret < 0)
+        goto out;
+    if(e != NULL) {
+        k = xattr_ent_size(e);
+        memmove(e,e + k,all + len - e - k);
+        len -= k;
+    }
+    if(value != NULL) {
+        e = all + len;
+        e[0] = nlen;
+        e[1] = size & 0xff;
+        e[2] = size >> 8;
+        memcpy(e + XATTR_ENT,name,nlen);
+        memcpy(e + XATTR_ENT + nlen,value,size);
+        len += XATTR_ENT + nlen + size;
+    }
+
+    for(off = 0;off < len;off += k) {
+        k = xattr_ent_size(all + off);
+        mask |= xattr_bit(all + off + XATTR_ENT,(unsigned char)all[off]);
+        if(ilen + k <= XATTR_INLINE) {
+            memcpy(inl + ilen,all + off,k);
+            ilen += k;
+        }
+        else {
+            memcpy(bl + blen,all + off,k);
+            blen += k;
+        }
+    }
+    if(blen > BLOCK_SIZE - sizeof(xattr_block)) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    if(blen > 0) {
+        hash = name_hash_of(bl,blen);
+        if((i = xattr_same(bl,blen,hash)) >= 0) {
+            n = xattr_shared[i].nr;
+            if(n != old)
+                xattr_shared[i].refs++;
+        }
+        else {
+            if(old != 0 && (i = xattr_slot(old)) >= 0 && xattr_shared[i].refs == 1)
+                n = old;            //只有自己在用，原地改写
+            else {
+                if((n = malloc_block(p)) < 0) {
+                    ret = n;
+                    goto out;
+                }
+                p->st->st_blocks--;
+                i = xattr_nshared++;
+                xattr_shared[i].nr = n;
+                xattr_shared[i].refs = 1;
+            }
+            if((h = (xattr_block *)blk(n)) == NULL) {
+                ret = -EIO;
+                goto out;
+            }
+            if(block_sum)
+                sum_begin(n);
+            h->hash = hash;
+            h->len = blen;
+            memcpy(h + 1,bl,blen);
+            if(block_sum)
+                sum_end(n,(char *)h);
+            DIRTY_BLOCK(n);
+            journal_append(J_DATA,0,n,0,sizeof(xattr_block) + blen,h,sizeof(xattr_block) + blen);
+        }
+    }
+    if(old != 0 && old != n)
+        xattr_unref(p);
+    p->xattr.block = n;
+    p->xattr.len = ilen;
+    memcpy(p->xattr.data,inl,ilen);
+    //位图最后改：不查锁的读者看到位被置上时，记录已经写好了
+    __atomic_store_n(&p->xattr.mask,mask,__ATOMIC_RELEASE);
+    DIRTY_INODE(p->st->st_ino);
+    journal_append(J_XATTR,p->st->st_ino,n,0,0,&p->xattr,sizeof(xattr_head));
+out:
+    free(all);
+    return ret;
+}
+
+
+//回收inode，inode上的块交给回收线程释放
+static void free_inode(inode *p)
+{
+    int i,j,k;
+
+    if(!p)  return;
+    i = p->st->st_ino;
+    map_write_begin(i);
+    trun(p,0);
+    xattr_unref(p);
+    __atomic_add_fetch(&inode_gen[i],1,__ATOMIC_RELEASE);
+    node[i] = NULL;
+    map_write_end(i);
+
+    j = i / 32;
+    k = i % 32;
+    inode_bitmap[j] -= (1 << k); 
+    super->free_inodes++;
+    DIRTY_META();
+    //读者可能还拿着inode的地址
+    ebr_sync();
+    munmap(p,INODE_SIZE);
+}
+
+
+//删除目录项d，inode的最后一个链接被删除时才回收它和它的块
+//调用者持有mem_lock读锁
+static void unlink_dent(int d)
+{
+    int ino = dent_ino[d];
+
+    dent_del(d);
+    DIRTY_INODE(ino);
+    if(__sync_sub_and_fetch(&attr[ino].st_nlink,1) == 0) {
+        wc_drop(ino);
+        free_inode((inode *)node[ino]);
+    }
+}
+
+
+//按文件名找目录项，找不到返回-1
+//先比较哈希数组，哈希相同时才去字符串池比较名字
+//不在name_order上二分：它在name_lock下整段memmove，不加锁二分会看到挪了一半的数组，
+//加锁又会让所有getattr、open排在同一把锁上；哈希数组只有DENTNUM*4字节，顺序扫描不拿锁
+static int lookup_name(const char *name)
+{
+    size_t len = strlen(name);
+    uint32_t h = name_hash_of(name,len);
+    int i;
+
+    for(i = 1;i < DENTNUM;i++)
+        if(__atomic_load_n(&name_hash[i],__ATOMIC_ACQUIRE) == h &&
+           name_len[i] == len && memcmp(name_ptr[i],name,len) == 0)
+            return i;
+    return -1;
+}
+
+
+//QUERY_PATH/PATTERN或其下路径中PATTERN的起点，不是这样的路径时返回NULL
+static const char *query_pattern(const char *path)
+{
+    size_t n = sizeof(QUERY_PATH) - 1;
+
+    if(strncmp(path,QUERY_PATH,n) != 0 || path[n] != '/' || path[n + 1] == '\0')
+        return NULL;
+    return path + n + 1;
+}
+
+
+//QUERY_PATH本身以及QUERY_PATH/PATTERN都是只读的目录
+static int query_dir(const char *path)
+{
+    const char *q = query_pattern(path);
+
+    return strcmp(path,QUERY_PATH) == 0 || (q != NULL && strchr(q,'/') == NULL);
+}
+
+
+//按路径找目录项
+//查询目录中的文件就是根目录下的同名文件，只是名字必须与查询的模式匹配
+static int lookup(const char *path)
+{
+    char pattern[MAX_FILENAME];
+    const char *q = query_pattern(path),*s;
+
+    if(q == NULL)
+        return lookup_name(path + 1);
+    if((s = strchr(q,'/')) == NULL || s - q >= MAX_FILENAME)
+        return -1;
+    memcpy(pattern,q,s - q);
+    pattern[s - q] = '\0';
+    if(fnmatch(pattern,s + 1,FNM_PERIOD) != 0)
+        return -1;
+    return lookup_name(s + 1);
+}
+
+
+//查询目录是只读的视图，经它的任何修改都返回EROFS
+static int query_ro(const char *path)
+{
+    return strcmp(path,QUERY_PATH) == 0 || query_pattern(path) != NULL;
+}
+
+
+//新建、链接或改名得到的路径能否用作文件名，不能时返回错误码：
+//查询目录下的路径为EROFS，虚拟文件的名字和其余带'/'的路径为EACCES
+static int name_reserved(const char *path)
+{
+    if(query_ro(path))
+        return -EROFS;
+    if(strchr(path + 1,'/') != NULL || strcmp(path,STATS_PATH) == 0)
+        return -EACCES;
+    return 0;
+}
+
+
+static ssize_t query_count,query_scanned;     //统计值：查询次数，以及查询时比较过的文件名数
+
+
+//目录项d的属性，交给readdir的filler，只用属性数组，不碰存块映射的inode页
+static void dent_stat(int d,struct stat *st)
+{
+    int i = dent_ino[d];
+
+    //由于使用的是struct filestate而非struct stat，逐个赋值
+    st->st_ino = attr[i].st_ino;
+    st->st_mode = attr[i].st_mode;
+    st->st_nlink = attr[i].st_nlink;
+    st->st_uid = attr[i].st_uid;
+    st->st_gid = attr[i].st_gid;
+    st->st_size = file_size(i);
+    st->st_blksize = attr[i].st_blksize;
+    st->st_blocks = attr[i].st_blocks;
+}
+
+
+//列出名字与pattern（fnmatch的通配符）匹配的文件：第一个通配符之前的部分是固定前缀，
+//在name_order中二分找到带这个前缀的第一个名字，只比较带这个前缀的名字
+static void query_readdir(const char *pattern,void *buf,fuse_fill_dir_t filler)
+{
+    size_t plen = strcspn(pattern,"*?[\\");
+    //最常见的"前缀*"只需比较前缀，不用fnmatch
+    int prefix_only = plen > 0 && strcmp(pattern + plen,"*") == 0;
+    struct stat st;
+    ssize_t n = 0;
+    int i,d;
+
+    memset(&st,0,sizeof(st));
+    pthread_mutex_lock(&name_lock);
+    for(i = name_lower(pattern,plen);i < name_count;i++) {
+        d = name_order[i];
+        if(name_len[d] < plen || memcmp(name_ptr[d],pattern,plen) != 0)
+            break;
+        n++;
+        if(!prefix_only && fnmatch(pattern,name_ptr[d],FNM_PERIOD) != 0)
+            continue;
+        dent_stat(d,&st);
+        if(filler(buf,name_ptr[d],&st,0))
+            break;
+    }
+    pthread_mutex_unlock(&name_lock);
+    __sync_fetch_and_add(&query_count,1);
+    __sync_fetch_and_add(&query_scanned,n);
+}
+
+
+//取得文件的inode
+static struct inode *get_inode(const char *name)
+{
+    int d = lookup(name);
+
+    return d > 0 ? (inode *)node[dent_ino[d]] : NULL;
+}
+
+
+static int create_inode(const char *filename, const struct stat *st)
+{
+    int t;
+    struct inode *new;
+
+    if(strlen(filename) >= MAX_FILENAME)
+        return -ENAMETOOLONG;
+    if((t = malloc_inode()) < 0)
+        return t;
+    new = (inode *)node[t];
+    new->st = &attr[t];
+    //  由于使用的是struct filestate而非struct stat 因此逐个赋值
+    new->st->st_ino = t;
+    new->st->st_mode = S_IFREG | 0644;
+    new->st->st_nlink = 1;
+    new->st->st_uid = fuse_get_context()->uid;
+    new->st->st_gid = fuse_get_context()->gid;
+    new->st->st_blksize = BLOCK_SIZE;
+    new->st->st_blocks = 0;
+    new->st->st_size = 0;
+    new->bindirect = 0;
+    new->tindirect = 0;
+    new->last_block = 0;
+    for(int i=0;i < BLOCKS_INODE;i++)
+        new->blnum[i] = 0;
+    if(dent_add(t,filename) < 0) {
+        free_inode(new);
+        return -ENOSPC;
+    }
+    DIRTY_INODE(t);
+    if(journal_fd >= 0) {
+        jcreate jc;
+        memset(&jc,0,sizeof(jc));
+        jc.st = *new->st;
+        strcpy(jc.filename,filename);
+        journal_append(J_CREATE,t,0,0,0,&jc,sizeof(jc));
+    }
+    return 0;
+}
+
+
+//把目录项a改名为newname，只改名字，不碰inode和数据块
+//flags为RENAME_EXCHANGE时交换a和b指向的inode，否则b不为0时是被替换掉的目录项
+//调用者持有mem_lock读锁
+static void rename_dent(int a,int b,int flags,const char *newname)
+{
+    int ino;
+
+    if(flags & RENAME_EXCHANGE) {
+        ino = dent_ino[a];
+        dent_ino[a] = dent_ino[b];
+        dent_ino[b] = ino;
+        DIRTY_NAMES();
+        return;
+    }
+    //先让新名字指向a的inode再删除b，查找newname的线程总能找到其中一个
+    name_set(a,newname);
+    DIRTY_NAMES();
+    if(b > 0)
+        unlink_dent(b);
+}
+
+
+//把文件截断或扩大到size，调用者持有mem_lock读锁
+static void truncate_inode(inode *node,off_t size)
+{
+    ssize_t j,n;
+    int32_t *add;
+    char *p;
+
+    if(size >= node->st->st_size) {
+        //增大文件只需要改大小，未分配的块读出来是0
+        node->st->st_size = size;
+        DIRTY_INODE(node->st->st_ino);
+        return;
+    }
+    j = (size + BLOCK_MASK) >> blk_shift;       //保留前j个block
+    map_write_begin(node->st->st_ino);
+    node->st->st_size = size;
+    //最后一个保留的块中，size之后的部分清零
+    if((size & BLOCK_MASK) != 0) {
+        n = lookforblnum(node,j - 1,&add);
+        if(n != 0 && (p = blk(n)) != NULL) {
+            if(block_sum)
+                sum_begin(n);
+            memset(p + (size & BLOCK_MASK),0,BLOCK_SIZE - (size & BLOCK_MASK));
+            if(block_sum)
+                sum_end(n,NULL);
+            DIRTY_BLOCK(n);
+        }
+    }
+    //从第j个块开始，把后面的块摘下来交给回收线程
+    node->st->st_blocks -= trun(node,j);
+    map_write_end(node->st->st_ino);
+}
+
+
+//检查点文件格式：文件头，[superblock块+block位图]，若干inode记录，[全部目录项]，若干block记录
+//基础镜像包含全部已分配的inode和block，增量只包含上次检查点之后的脏数据
+typedef struct {
+    char magic[8];
+    int32_t blocksize;
+    int32_t blocknum;
+    int32_t inodenum;
+    int32_t gen;                //基础镜像的代数，增量只能叠加在同一代的基础镜像上
+    int32_t seq;                //0为基础镜像，n为第n个增量
+    int32_t meta;               //是否包含superblock和block位图
+    int32_t ninodes;
+    int32_t nblocks;
+    int32_t names;              //是否包含目录项
+    int32_t ndents;
+} ckpt_header;
+
+typedef struct {
+    int32_t ino;
+    int32_t used;               //为0表示该inode已被回收
+    ssize_t blnum[BLOCKS_INODE];
+    ssize_t bindirect;
+    ssize_t tindirect;
+    int32_t last_block;
+    struct filestate st;
+    xattr_head xattr;
+} ckpt_inode;
+
+//目录项记录，后跟len字节的文件名
+typedef struct {
+    int32_t ino;
+    int32_t len;
+} ckpt_dent;
+
+static int ckpt_gen;                //当前基础镜像的代数，0表示还没有基础镜像
+static int ckpt_seq;                //当前基础镜像之上已有的增量数
+static ssize_t ckpt_last_blocks;    //上一次检查点写出的block数
+static sem_t ckpt_sem;
+
+
+static int block_used(ssize_t n)
+{
+    return (block_bitmap[n / 32] >> (n % 32)) & 1;
+}
+
+
+static int inode_used(int i)
+{
+    return (inode_bitmap[i / 32] >> (i % 32)) & 1;
+}
+
+
+//检查点已经包含了日志中的所有修改，清空日志，新的日志接在这个检查点之后
+//调用者持有mem_lock写锁，不会有新的记录追加进来
+static void journal_reset()
+{
+    jheader h;
+
+    if(journal_fd < 0)
+        return;
+    pthread_mutex_lock(&journal_lock);
+    while(jflushing)
+        pthread_cond_wait(&journal_cond,&journal_lock);
+    free(jbuf);
+    jbuf = NULL;
+    jlen = jcap = 0;
+    memcpy(h.magic,JOURNAL_MAGIC,8);
+    h.gen = ckpt_gen;
+    h.seq = ckpt_seq;
+    h.blocksize = BLOCK_SIZE;
+    if(ftruncate(journal_fd,0) != 0 || pwrite(journal_fd,&h,sizeof(h),0) != sizeof(h))
+        perror("journal");
+    fdatasync(journal_fd);
+    jfile_off = sizeof(h);
+    jdurable = jlsn;
+    pthread_cond_broadcast(&journal_cond);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+
+//检查点的输出流：同步时用stdio，io_uring时拷进注册过的缓冲区，写满一个就提交，
+//不等它完成就继续填下一个
+typedef struct ckpt_out {
+    FILE *f;
+    int fd;
+    uring *r;
+    off_t off;                  //当前缓冲区在文件中的位置
+    int cur;                    //正在填的缓冲区
+    size_t fill;                //当前缓冲区已填的字节数
+} ckpt_out;
+
+static int ur_chunk_busy[UR_CHUNKS];    //缓冲区是否还在写，只有持有mem_lock写锁的线程使用
+
+
+static void ckpt_chunk_done(uring *r,unsigned tag,int res)
+{
+    ur_chunk_busy[tag] = 0;
+}
+
+
+static int ckpt_open(ckpt_out *o,const char *tmp)
+{
+    struct iovec iov;
+
+    memset(o,0,sizeof(*o));
+    o->fd = -1;
+    if((o->r = ur_get()) != NULL) {
+        if(ur_arena == NULL) {
+            ur_arena = mmap(NULL, UR_CHUNK * UR_CHUNKS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(ur_arena == MAP_FAILED)
+                ur_arena = NULL;
+        }
+        //注册后内核不必每次请求都去固定用户页
+        if(ur_arena != NULL && !o->r->registered) {
+            iov.iov_base = ur_arena;
+            iov.iov_len = UR_CHUNK * UR_CHUNKS;
+            o->r->registered = syscall(__NR_io_uring_register,o->r->fd,IORING_REGISTER_BUFFERS,&iov,1) == 0;
+        }
+        if(o->r->registered && (o->fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+            o->r->done = ckpt_chunk_done;
+            return 0;
+        }
+        o->r = NULL;
+    }
+    if((o->f = fopen(tmp,"w")) == NULL)
+        return -errno;
+    return 0;
+}
+
+
+static void ckpt_flush(ckpt_out *o)
+{
+    struct io_uring_sqe *sqe;
+
+    if(o->fill == 0)
+        return;
+    ur_chunk_busy[o->cur] = 1;
+    sqe = ur_sqe(o->r,IORING_OP_WRITE_FIXED,o->fd,ur_arena + (size_t)o->cur * UR_CHUNK,o->fill,o->off,o->cur);
+    sqe->buf_index = 0;
+    ur_submit(o->r,0);
+    o->off += o->fill;
+    o->fill = 0;
+    o->cur = (o->cur + 1) % UR_CHUNKS;
+    //下一个缓冲区可能还没写完
+    while(ur_chunk_busy[o->cur])
+        ur_submit(o->r,1);
+}
+
+
+static void ckpt_put(ckpt_out *o,const void *data,size_t len)
+{
+    size_t k;
+
+    if(o->f != NULL) {
+        fwrite(data,len,1,o->f);
+        return;
+    }
+    while(len > 0) {
+        k = UR_CHUNK - o->fill < len ? UR_CHUNK - o->fill : len;
+        memcpy(ur_arena + (size_t)o->cur * UR_CHUNK + o->fill,data,k);
+        o->fill += k;
+        data = (const char *)data + k;
+        len -= k;
+        if(o->fill == UR_CHUNK)
+            ckpt_flush(o);
+    }
+}
+
+
+//写完剩下的数据并fsync，成功返回0
+static int ckpt_close(ckpt_out *o)
+{
+    int ret;
+
+    if(o->f != NULL) {
+        ret = fflush(o->f) != 0 || fsync(fileno(o->f)) != 0 ? -EIO : 0;
+        fclose(o->f);
+        return ret;
+    }
+    ckpt_flush(o);
+    ret = ur_wait(o->r);
+    if(ret == 0) {
+        ur_sqe(o->r,IORING_OP_FSYNC,o->fd,NULL,0,0,0);
+        ret = ur_wait(o->r);
+    }
+    o->r->done = NULL;
+    close(o->fd);
+    return ret < 0 ? -EIO : 0;
+}
+
+
+//把检查点写到options.checkpoint（基础镜像）或options.checkpoint.seq（增量）
+//先写临时文件，fsync后再rename，崩溃时不会留下写了一半的检查点
+//调用者持有mem_lock写锁
+static int ckpt_write(int full)
+{
+    char path[PATH_MAX],tmp[PATH_MAX + 8];
+    char *buf = NULL;
+    ckpt_header h;
+    ckpt_inode ci;
+    ckpt_out o;
+    ssize_t n;
+    int i;
+
+    memset(&h,0,sizeof(h));
+    memcpy(h.magic,CKPT_MAGIC,8);
+    h.blocksize = BLOCK_SIZE;
+    h.blocknum = BLOCKNUM;
+    h.inodenum = INODENUM;
+    h.gen = full ? ckpt_gen + 1 : ckpt_gen;
+    h.seq = full ? 0 : ckpt_seq + 1;
+    h.meta = full || meta_dirty;
+    h.names = full || names_dirty;
+    for(i = 1;i < DENTNUM && h.names;i++)
+        if(name_hash[i] != 0)
+            h.ndents++;
+    for(i = 1;i < INODENUM;i++)
+        if(full ? inode_used(i) : inode_dirty[i])
+            h.ninodes++;
+    for(n = 2;n < BLOCKNUM;n++)
+        if(block_used(n) && (full || block_dirty[n]))
+            h.nblocks++;
+
+    if(full)
+        snprintf(path,sizeof(path),"%s",options.checkpoint);
+    else
+        snprintf(path,sizeof(path),"%s.%d",options.checkpoint,h.seq);
+    snprintf(tmp,sizeof(tmp),"%s.tmp",path);
+    if(ckpt_open(&o,tmp) != 0)
+        return -errno;
+
+    ckpt_put(&o,&h,sizeof(h));
+    if(h.meta) {
+        ckpt_put(&o,mem[0],SUPER_SIZE);
+        ckpt_put(&o,block_bitmap,BITMAP_SIZE);
+    }
+    for(i = 1;i < INODENUM;i++) {
+        if(!(full ? inode_used(i) : inode_dirty[i]))
+            continue;
+        memset(&ci,0,sizeof(ci));
+        ci.ino = i;
+        ci.used = inode_used(i) && node[i] != NULL;
+        if(ci.used) {
+            inode *p = (inode *)node[i];
+            memcpy(ci.blnum,p->blnum,sizeof(ci.blnum));
+            ci.bindirect = p->bindirect;
+            ci.tindirect = p->tindirect;
+            ci.last_block = p->last_block;
+            ci.st = *p->st;
+            ci.xattr = p->xattr;
+        }
+        ckpt_put(&o,&ci,sizeof(ci));
+    }
+    for(i = 1;i < DENTNUM && h.names;i++) {
+        if(name_hash[i] == 0)
+            continue;
+        ckpt_dent cd = {dent_ino[i],name_len[i]};
+        ckpt_put(&o,&cd,sizeof(cd));
+        ckpt_put(&o,name_ptr[i],cd.len);
+    }
+    for(n = 2;n < BLOCKNUM;n++) {
+        if(!block_used(n) || !(full || block_dirty[n]))
+            continue;
+        int32_t nr = n;
+        ckpt_put(&o,&nr,sizeof(nr));
+        //换出的块直接从spill文件读，不必换回内存
+        if(mem[n] != NULL)
+            ckpt_put(&o,mem[n],BLOCK_SIZE);
+        else {
+            if(buf == NULL)
+                buf = malloc(BLOCK_SIZE);
+            if(!spilled[n] || pread(spill_fd,buf,BLOCK_SIZE,(off_t)n * BLOCK_SIZE) != BLOCK_SIZE)
+                memset(buf,0,BLOCK_SIZE);
+            ckpt_put(&o,buf,BLOCK_SIZE);
+        }
+    }
+    free(buf);
+
+    if(ckpt_close(&o) != 0) {
+        unlink(tmp);
+        return -EIO;
+    }
+    if(rename(tmp,path) != 0)
+        return -errno;
+
+    if(full) {
+        //新的基础镜像已经包含了旧增量的内容，删掉它们
+        for(i = 1;i <= ckpt_seq;i++) {
+            snprintf(path,sizeof(path),"%s.%d",options.checkpoint,i);
+            unlink(path);
+        }
+        ckpt_gen = h.gen;
+        ckpt_seq = 0;
+    }
+    else
+        ckpt_seq = h.seq;
+    ckpt_last_blocks = h.nblocks;
+    journal_reset();
+    memset(block_dirty,0,sizeof(block_dirty));
+    memset(inode_dirty,0,sizeof(inode_dirty));
+    meta_dirty = 0;
+    names_dirty = 0;
+    return 0;
+}
+
+
+//做一次检查点：还没有基础镜像或增量太多时写基础镜像，否则写增量
+static void checkpoint()
+{
+    int ret;
+
+    pthread_rwlock_wrlock(&mem_lock);
+    ret = ckpt_write(ckpt_gen == 0 || ckpt_seq >= options.checkpoint_deltas);
+    pthread_rwlock_unlock(&mem_lock);
+    if(ret < 0)
+        fprintf(stderr,"checkpoint %s: %s\n",options.checkpoint,strerror(-ret));
+}
+
+
+static void ckpt_signal(int sig)
+{
+    sem_post(&ckpt_sem);
+}
+
+
+//检查点线程：每隔checkpoint_interval秒，或者收到SIGUSR1时做一次检查点
+static void *ckpt_worker(void *arg)
+{
+    struct timespec ts;
+
+    for(;;) {
+        if(options.checkpoint_interval) {
+            clock_gettime(CLOCK_REALTIME,&ts);
+            ts.tv_sec += options.checkpoint_interval;
+            while(sem_timedwait(&ckpt_sem,&ts) != 0 && errno == EINTR)
+                ;
+        }
+        else
+            while(sem_wait(&ckpt_sem) != 0)
+                ;
+        checkpoint();
+    }
+    return NULL;
+}
+
+
+//读入一个检查点文件，覆盖内存中对应的superblock、位图、inode和block
+//恢复时换出线程还没有启动，内存中的块超出预算时就地换出
+//此时只有一个线程，不必加mem_lock；调用者不能拿着任何块的地址
+static void restore_evict()
+{
+    if(spill_fd >= 0 && resident > resident_budget)
+        evict_blocks(resident_budget - resident_budget / 16);
+}
+
+
+static int ckpt_apply(const char *path,int seq)
+{
+    ckpt_header h;
+    ckpt_inode ci;
+    ckpt_dent cd;
+    char name[MAX_FILENAME];
+    int32_t nr;
+    inode *p;
+    FILE *f;
+    int i;
+
+    if((f = fopen(path,"r")) == NULL)
+        return -errno;
+    if(fread(&h,sizeof(h),1,f) != 1 || memcmp(h.magic,CKPT_MAGIC,8) != 0 ||
+       h.blocksize != BLOCK_SIZE || h.blocknum != BLOCKNUM || h.inodenum != INODENUM ||
+       h.seq != seq || (seq > 0 && h.gen != ckpt_gen)) {
+        fclose(f);
+        return -EINVAL;
+    }
+    if(h.meta && (fread(mem[0],SUPER_SIZE,1,f) != 1 || fread(block_bitmap,BITMAP_SIZE,1,f) != 1))
+        goto bad;
+    for(i = 0;i < h.ninodes;i++) {
+        if(fread(&ci,sizeof(ci),1,f) != 1 || ci.ino <= 0 || ci.ino >= INODENUM)
+            goto bad;
+        p = (inode *)node[ci.ino];
+        if(!ci.used) {
+            if(p) {
+                munmap(p,INODE_SIZE);
+                node[ci.ino] = NULL;
+            }
+            continue;
+        }
+        if(p == NULL) {
+            p = mmap(NULL, INODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            p->st = &attr[ci.ino];
+            node[ci.ino] = p;
+        }
+        memcpy(p->blnum,ci.blnum,sizeof(ci.blnum));
+        p->bindirect = ci.bindirect;
+        p->tindirect = ci.tindirect;
+        p->last_block = ci.last_block;
+        *p->st = ci.st;
+        p->xattr = ci.xattr;
+    }
+    if(h.names) {
+        //目录项总是整体写出，先清掉旧的
+        for(i = 1;i < DENTNUM;i++)
+            if(dent_ino[i] != 0)
+                dent_del(i);
+        for(i = 0;i < h.ndents;i++) {
+            if(fread(&cd,sizeof(cd),1,f) != 1 || cd.ino <= 0 || cd.ino >= INODENUM ||
+               cd.len < 0 || cd.len >= MAX_FILENAME || fread(name,cd.len,1,f) != 1)
+                goto bad;
+            name[cd.len] = '\0';
+            dent_add(cd.ino,name);
+        }
+    }
+    for(i = 0;i < h.nblocks;i++) {
+        if(fread(&nr,sizeof(nr),1,f) != 1 || nr < 2 || nr >= BLOCKNUM)
+            goto bad;
+        //块的内容整块覆盖，换出的块不必读回
+        restore_evict();
+        if(mem[nr] == NULL) {
+            mem[nr] = mmap(NULL, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            spilled[nr] = 0;
+            tier_account(nr);
+        }
+        if(fread(mem[nr],BLOCK_SIZE,1,f) != 1)
+            goto bad;
+    }
+    fclose(f);
+    ckpt_gen = h.gen;
+    ckpt_seq = seq;
+    return 0;
+bad:
+    fclose(f);
+    return -EIO;
+}
+
+
+//立即释放回收队列中的所有块，只在恢复时使用，此时回收线程还没有启动
+static void reclaim_drain()
+{
+    reclaim *r;
+
+    while((r = reclaim_pop()) != NULL) {
+        reclaim_release(r);
+        reclaim_busy--;
+    }
+}
+
+
+//恢复时取得第n块，需要时分配内存或从spill文件读回；zero表示这是新分配的块，内容应为0
+//返回的地址只在下一次调用restore_evict之前有效
+static char *journal_block(int32_t n,int zero)
+{
+    char *p;
+
+    restore_evict();
+    if((p = blk(n)) == NULL) {
+        p = mem[n] = mmap(NULL, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        tier_account(n);
+    }
+    else if(zero)
+        memset(p,0,BLOCK_SIZE);
+    return p;
+}
+
+
+//在检查点之上重放日志，返回重放的记录数
+//日志末尾写了一半的记录被截掉，之后的记录接着追加在后面
+static int journal_replay(const char *path)
+{
+    jheader h;
+    jrec r;
+    jcreate jc;
+    xattr_head xh;
+    char *data;
+    char name[2][MAX_FILENAME];
+    off_t valid;
+    int32_t *add;
+    inode *p;
+    int cnt = 0;
+    int fd,a,b;
+
+    if((fd = open(path,O_RDWR)) < 0)
+        return 0;
+    if(read(fd,&h,sizeof(h)) != sizeof(h) || memcmp(h.magic,JOURNAL_MAGIC,8) != 0 ||
+       h.gen != ckpt_gen || h.seq != ckpt_seq || h.blocksize != BLOCK_SIZE) {
+        //日志不是接在这个检查点之后的，其中的修改已经包含在检查点中
+        close(fd);
+        return 0;
+    }
+    data = malloc(BLOCK_SIZE);
+    valid = sizeof(h);
+    while(read(fd,&r,sizeof(r)) == sizeof(r)) {
+        if(r.ino < 0 || r.ino >= INODENUM)
+            break;
+        p = (inode *)node[r.ino];
+        if(r.type == J_CREATE) {
+            if(read(fd,&jc,sizeof(jc)) != sizeof(jc))
+                break;
+            if(p == NULL) {
+                p = mmap(NULL, INODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                p->st = &attr[r.ino];
+                node[r.ino] = p;
+            }
+            if(!inode_used(r.ino)) {
+                inode_bitmap[r.ino / 32] += 1 << (r.ino % 32);
+                super->free_inodes--;
+            }
+            jc.filename[MAX_FILENAME - 1] = '\0';
+            dent_add(r.ino,jc.filename);
+            memset(p->blnum,0,sizeof(p->blnum));
+            p->bindirect = 0;
+            p->tindirect = 0;
+            p->last_block = 0;
+            memset(&p->xattr,0,sizeof(p->xattr));
+            *p->st = jc.st;
+        }
+        else if(r.type == J_DATA) {
+            if(r.c < 0 || r.b < 0 || r.b + r.c > BLOCK_SIZE || r.a < 2 || r.a >= BLOCKNUM ||
+               read(fd,data,r.c) != r.c)
+                break;
+            memcpy(journal_block(r.a,0) + r.b,data,r.c);
+        }
+        else if(r.type == J_RENAME) {
+            if(read(fd,name,sizeof(name)) != sizeof(name))
+                break;
+            name[0][MAX_FILENAME - 1] = name[1][MAX_FILENAME - 1] = '\0';
+            a = lookup_name(name[0]);
+            b = lookup_name(name[1]);
+            if(a > 0 && (b > 0 || !(r.b & RENAME_EXCHANGE))) {
+                rename_dent(a,b > 0 ? b : 0,r.b,name[1]);
+                reclaim_drain();
+            }
+        }
+        else if(r.type == J_UNLINK || r.type == J_LINK) {
+            if(read(fd,name[0],MAX_FILENAME) != MAX_FILENAME)
+                break;
+            name[0][MAX_FILENAME - 1] = '\0';
+            if(r.type == J_LINK && p != NULL) {
+                dent_add(r.ino,name[0]);
+                p->st->st_nlink++;
+            }
+            else if(r.type == J_UNLINK && (a = lookup_name(name[0])) > 0) {
+                unlink_dent(a);
+                reclaim_drain();
+            }
+        }
+        else if(r.type == J_XATTR) {
+            if(read(fd,&xh,sizeof(xh)) != sizeof(xh) || xh.len > XATTR_INLINE)
+                break;
+            //块的引用数和bitmap在恢复之后重建
+            if(p != NULL)
+                p->xattr = xh;
+        }
+        else if(p == NULL)
+            ;
+        else if(r.type == J_INDEX) {
+            //块号、索引槽或文件内块序号越界的记录是坏的，停在这里
+            if(r.a < 1 || r.a > 3 || r.c < 2 || r.c >= BLOCKNUM || (r.a == 3 && (r.b < 0 || r.b >= PTRS_BLOCK)))
+                break;
+            journal_block(r.c,1);
+            if(r.a == 1)
+                p->bindirect = r.c;
+            else if(r.a == 2)
+                p->tindirect = r.c;
+            else if(p->tindirect != 0)
+                ((int32_t *)blk(p->tindirect))[r.b] = r.c;
+        }
+        else if(r.type == J_MAP) {
+            if(r.a < 0 || r.a >= TBLOCK + PTRS_BLOCK * PTRS_BLOCK || r.b < 2 || r.b >= BLOCKNUM)
+                break;
+            lookforblnum(p,r.a,&add);
+            if(add) {
+                journal_block(r.b,1);
+                //分配时可能换出了索引块，重新取add
+                lookforblnum(p,r.a,&add);
+                *add = r.b;
+                p->st->st_blocks++;
+            }
+        }
+        else if(r.type == J_SIZE)
+            p->st->st_size = r.a;
+        else if(r.type == J_TRUNC) {
+            if(r.a < 0)
+                break;
+            truncate_inode(p,r.a);
+            reclaim_drain();
+        }
+        else if(r.type == J_MOVE) {
+            if(r.a < 0 || r.a >= TBLOCK + PTRS_BLOCK * PTRS_BLOCK)
+                break;
+            lookforblnum(p,r.a,&add);
+            if(add && *add == r.b && r.c >= 2 && r.c < BLOCKNUM &&
+               blk(r.b) != NULL && mem[r.c] == NULL && !spilled[r.c]) {
+                mem[r.c] = mem[r.b];
+                mem[r.b] = NULL;
+                *add = r.c;
+            }
+        }
+        valid = lseek(fd,0,SEEK_CUR);
+        cnt++;
+    }
+    if(ftruncate(fd,valid) != 0)
+        perror(path);
+    close(fd);
+    free(data);
+    return cnt;
+}
+
+
+//标记第n块被inode引用，若是索引块则继续标记它指向的块
+static void ckpt_mark(int32_t n,int level)
+{
+    int i;
+    int32_t c;
+    char *p;
+
+    restore_evict();
+    if(n < 2 || n >= BLOCKNUM || (p = blk(n)) == NULL)
+        return;
+    block_bitmap[n / 32] |= 1 << (n % 32);
+    //校验和不写进检查点，恢复后按恢复出的内容重新算
+    if(level == 0 && block_sum)
+        sum_store(n,SUM_VALID | crc32c_block(p));
+    //下一层可能把这个索引块换出，每次都重新取地址
+    for(i = 0;level > 0 && i < PTRS_BLOCK;i++)
+        if((c = ((int32_t *)blk(n))[i]) != 0)
+            ckpt_mark(c,level - 1);
+}
+
+
+//从基础镜像、它之后的增量以及日志恢复文件系统
+//检查点中记录的位图可能包含当时还在回收队列中的块，
+//因此恢复后根据inode实际引用的块重建block位图，并释放没有被引用的块
+static void ckpt_restore()
+{
+    char path[PATH_MAX];
+    int i,j,seq;
+    ssize_t n;
+    inode *p;
+
+    int applied = 0;
+
+    if(access(options.checkpoint,F_OK) == 0) {
+        if(ckpt_apply(options.checkpoint,0) < 0) {
+            fprintf(stderr,"checkpoint %s: bad image\n",options.checkpoint);
+            exit(1);
+        }
+        for(seq = 1;;seq++) {
+            snprintf(path,sizeof(path),"%s.%d",options.checkpoint,seq);
+            if(ckpt_apply(path,seq) < 0)
+                break;
+        }
+        applied = 1;
+    }
+    if(options.journal) {
+        snprintf(path,sizeof(path),"%s.journal",options.checkpoint);
+        if(journal_replay(path) > 0)
+            applied = 1;
+    }
+    if(!applied)
+        return;
+
+    //重建block位图，顺便重新数扩展属性块的引用数
+    memset(block_bitmap,0,BLOCKNUM / 32 * sizeof(int32_t));
+    block_bitmap[0] = 3;
+    xattr_nshared = 0;
+    for(i = 1;i < INODENUM;i++) {
+        if(!inode_used(i) || (p = (inode *)node[i]) == NULL)
+            continue;
+        for(j = 0;j < BLOCKS_INODE;j++)
+            ckpt_mark(p->blnum[j],0);
+        ckpt_mark(p->bindirect,1);
+        ckpt_mark(p->tindirect,2);
+        if(p->xattr.block == 0)
+            continue;
+        if(p->xattr.block < 2 || p->xattr.block >= BLOCKNUM || blk(p->xattr.block) == NULL) {
+            p->xattr.block = 0;
+            continue;
+        }
+        ckpt_mark(p->xattr.block,0);
+        if((j = xattr_slot(p->xattr.block)) < 0) {
+            j = xattr_nshared++;
+            xattr_shared[j].nr = p->xattr.block;
+            xattr_shared[j].refs = 0;
+        }
+        xattr_shared[j].refs++;
+    }
+    for(n = 2;n < BLOCKNUM;n++) {
+        if(block_used(n))
+            continue;
+        if(mem[n] != NULL) {
+            munmap(mem[n],BLOCK_SIZE);
+            mem[n] = NULL;
+            if(spill_fd >= 0)
+                resident--;
+        }
+        spilled[n] = 0;
+    }
+    for(i = 0;i < GROUPNUM;i++) {
+        groups[i].free = GROUP_BLOCKS;
+        for(j = 0;j < GROUP_BLOCKS / 32;j++)
+            groups[i].free -= __builtin_popcount(groups[i].bitmap[j]);
+    }
+    //重建之后的状态和磁盘上的检查点不同，下一次做基础镜像
+    ckpt_seq = options.checkpoint_deltas;
+}
+
+
+//后台整理：把碎片多的文件的块搬到连续的空闲块中
+//每个块是单独mmap的内存，搬动只是把mem[]中的指针挪到新块号下再改块映射，不拷贝数据
+//每搬一批都持有mem_lock写锁，读写请求看到的块映射要么全是旧的，要么全是新的
+static ssize_t defrag_moved,defrag_files;      //统计值：搬过的块数和整理过的文件数
+
+
+//从块n开始连续空闲的块数，最多数到max
+static ssize_t free_run_at(ssize_t n,ssize_t max)
+{
+    ssize_t k = 0;
+
+    while(k < max && n + k < BLOCKNUM && !block_used(n + k))
+        k++;
+    return k;
+}
+
+
+//从from开始（到末尾后绕回头部）找第一段不短于want的空闲块，返回它的起点
+//找不到时返回最长的一段，*len为找到的长度（不超过want）
+static ssize_t find_free_run(ssize_t from,ssize_t want,ssize_t *len)
+{
+    ssize_t i,n,k,best = 0;
+
+    *len = 0;
+    for(i = 0;i < BLOCKNUM;i += k + 1) {
+        n = (from + i) % BLOCKNUM;
+        k = free_run_at(n,want);
+        if(k > *len) {
+            best = n;
+            *len = k;
+            if(k == want)
+                break;
+        }
+    }
+    return best;
+}
+
+
+//文件的数据块数和连续段数：块号接着上一个数据块的块算同一段，空洞不打断一段
+static void file_runs(inode *p,ssize_t *blocks,ssize_t *runs)
+{
+    ssize_t j,n,end,prev = 0;
+    int32_t *add;
+
+    end = (p->st->st_size + BLOCK_MASK) >> blk_shift;
+    for(j = 0;j < end;j++) {
+        if((n = lookforblnum(p,j,&add)) == 0)
+            continue;
+        (*blocks)++;
+        if(n != prev + 1)
+            (*runs)++;
+        prev = n;
+    }
+}
+
+
+//碎片统计：文件的平均连续段长度，空闲块中最长的一段和空闲段数
+static void frag_report(double *avg_run,ssize_t *free_largest,ssize_t *free_runs)
+{
+    ssize_t blocks = 0,runs = 0,n,k;
+    int i;
+
+    for(i = 1;i < INODENUM;i++)
+        if(inode_used(i) && node[i] != NULL)
+            file_runs((inode *)node[i],&blocks,&runs);
+    *avg_run = runs ? (double)blocks / runs : 0;
+    *free_largest = *free_runs = 0;
+    for(n = 2;n < BLOCKNUM;n += k + 1) {
+        if((k = free_run_at(n,BLOCKNUM)) == 0)
+            continue;
+        (*free_runs)++;
+        if(k > *free_largest)
+            *free_largest = k;
+    }
+}
+
+
+//把ino号文件从第*j个块起的最多DEFRAG_BATCH个数据块搬到一段连续的空闲块中，
+//尽量接在*goal（上一批搬到的位置之后），*j和*goal前移到下一批
+//返回搬动的块数，-1表示文件已被删除、已经处理完或者找不到足够长的空闲段
+//调用者持有mem_lock写锁，这时没有别的线程分配、释放块或改块映射
+static ssize_t defrag_chunk(int ino,ssize_t *j,ssize_t *goal)
+{
+    int32_t old[DEFRAG_BATCH],*add[DEFRAG_BATCH];
+    ssize_t idx[DEFRAG_BATCH];
+    ssize_t i,k,end,m,len,n;
+    inode *p = (inode *)node[ino];
+
+    if(!inode_used(ino) || p == NULL)
+        return -1;
+    end = (p->st->st_size + BLOCK_MASK) >> blk_shift;
+    for(i = *j,k = 0;i < end && k < DEFRAG_BATCH;i++) {
+        if((n = lookforblnum(p,i,&add[k])) == 0)
+            continue;
+        //换出的块先读回来，搬的是内存中的指针
+        if(blk(n) == NULL)
+            return -1;
+        old[k] = n;
+        idx[k++] = i;
+    }
+    if(k == 0)
+        return -1;
+
+    //已经连续的一批，接不上goal时不必搬
+    for(n = 1;n < k && old[n] == old[0] + n;n++)
+        ;
+    if(n == k && (old[0] == *goal || *goal == 0 || free_run_at(*goal,k) < k)) {
+        *j = i;
+        *goal = old[0] + k;
+        return 0;
+    }
+    if(*goal != 0 && free_run_at(*goal,k) == k)
+        m = *goal;
+    else {
+        //从旧块所在的组开始找，整理后的文件仍在原来的组附近
+        m = find_free_run(old[0] / GROUP_BLOCKS * GROUP_BLOCKS,k,&len);
+        if(len < k) {
+            if(len < DEFRAG_RUN)
+                return -1;
+            k = len;
+            i = idx[k];
+        }
+    }
+
+    map_write_begin(ino);
+    for(n = 0;n < k;n++) {
+        block_bitmap[(m + n) / 32] += 1 << ((m + n) % 32);
+        groups[(m + n) / GROUP_BLOCKS].free--;
+        mem[m + n] = mem[old[n]];
+        mem[old[n]] = NULL;
+        //校验和跟着块走，旧块号上的在free_blocks中作废
+        if(block_sum)
+            sum_store(m + n,block_sum[old[n]] & (SUM_VALID | 0xffffffff));
+        if(spill_fd >= 0)
+            referenced[m + n] = 1;
+        *add[n] = m + n;
+        DIRTY_BLOCK(m + n);
+        if(idx[n] >= TBLOCK)
+            DIRTY_BLOCK(((int32_t *)blk(p->tindirect))[(idx[n] - TBLOCK) >> PTR_SHIFT]);
+        else if(idx[n] >= BLOCKS_INODE)
+            DIRTY_BLOCK(p->bindirect);
+        journal_append(J_MOVE,ino,idx[n],old[n],m + n,NULL,0);
+    }
+    //旧块的内存已经挪走，只需还给位图；拿着旧块号的读者会看到序号变了而重读
+    free_blocks(old,k);
+    map_write_end(ino);
+    if(p->tindirect != 0)
+        DIRTY_BLOCK(p->tindirect);
+    DIRTY_INODE(ino);
+    p->last_block = m + k - 1;
+    *j = i;
+    *goal = m + k;
+    defrag_moved += k;
+    return k;
+}
+
+
+//整理线程：轮流检查每个文件，平均连续段短于DEFRAG_RUN的文件一批一批地搬，
+//两批之间按defrag_rate睡眠，让出写锁给读写请求
+static void *defrag_worker(void *arg)
+{
+    ssize_t blocks,runs,j,goal,k,moved;
+    int ino;
+
+    for(;;) {
+        moved = 0;
+        for(ino = 1;ino < INODENUM;ino++) {
+            blocks = runs = 0;
+            pthread_rwlock_wrlock(&mem_lock);
+            if(inode_used(ino) && node[ino] != NULL)
+                file_runs((inode *)node[ino],&blocks,&runs);
+            pthread_rwlock_unlock(&mem_lock);
+            if(runs <= 1 || blocks >= runs * DEFRAG_RUN)
+                continue;
+            defrag_files++;
+            for(j = goal = 0;;) {
+                pthread_rwlock_wrlock(&mem_lock);
+                k = defrag_chunk(ino,&j,&goal);
+                pthread_rwlock_unlock(&mem_lock);
+                if(k < 0)
+                    break;
+                moved += k;
+                if(k > 0)
+                    usleep(k * 1000000ULL / options.defrag_rate);
+            }
+        }
+        if(moved == 0)
+            sleep(DEFRAG_IDLE);
+    }
+    return NULL;
+}
+
+
+//block大小为size时对应的blk_shift，size不是允许的大小时返回-1
+static int block_shift_of(unsigned size)
+{
+    int shift;
+
+    if(size == 0 || (size & (size - 1)) != 0)
+        return -1;
+    shift = __builtin_ctz(size);
+    return shift >= MIN_BLOCK_SHIFT && shift <= MAX_BLOCK_SHIFT ? shift : -1;
+}
+
+
+//已有的检查点（没有基础镜像时看日志）记录的block大小，没有时返回0
+static int image_blocksize()
+{
+    char path[PATH_MAX];
+    ckpt_header h;
+    jheader jh;
+    FILE *f;
+    int size = 0;
+
+    if((f = fopen(options.checkpoint,"r")) != NULL) {
+        if(fread(&h,sizeof(h),1,f) == 1 && memcmp(h.magic,CKPT_MAGIC,8) == 0)
+            size = h.blocksize;
+        fclose(f);
+        return size;
+    }
+    snprintf(path,sizeof(path),"%s.journal",options.checkpoint);
+    if(options.journal && (f = fopen(path,"r")) != NULL) {
+        if(fread(&jh,sizeof(jh),1,f) == 1 && memcmp(jh.magic,JOURNAL_MAGIC,8) == 0 && jh.gen == 0)
+            size = jh.blocksize;
+        fclose(f);
+    }
+    return size;
+}
+
+
+//离线构建镜像：把SRC目录中的普通文件直接写成检查点基础镜像，之后用-o checkpoint挂载
+//文件系统没有子目录，只导入SRC下一层的普通文件。每个文件的数据块和索引块事先在位图中
+//连续划好，镜像中各个块记录的位置随之确定，多个线程各自读源文件，用pwritev写到各自的位置
+typedef struct {
+    char *name;
+    struct stat st;
+    int32_t first;              //第一个数据块号，数据块之后紧接着索引块
+    ssize_t nblocks;            //数据块数
+    ssize_t nindex;             //索引块数
+} build_file;
+
+static build_file *build_files;
+static int build_nfiles;
+static int build_next;              //下一个要拷贝的文件，工作线程原子地取
+static int build_src = -1;          //SRC目录
+static int build_fd = -1;           //正在写的镜像
+static off_t build_base;            //2号块的记录在镜像中的位置
+static int build_errors;
+
+
+//文件有n个数据块时需要的索引块数
+static ssize_t build_index_blocks(ssize_t n)
+{
+    if(n <= BLOCKS_INODE)
+        return 0;
+    if(n <= TBLOCK)
+        return 1;
+    return 2 + ((n - TBLOCK + PTRS_BLOCK - 1) >> PTR_SHIFT);
+}
+
+
+//块nr的记录在镜像中的位置
+static off_t build_off(int32_t nr)
+{
+    return build_base + (off_t)(nr - 2) * (sizeof(int32_t) + BLOCK_SIZE);
+}
+
+
+//从块号nr起连续写cnt个块的记录，内容在data中
+static int build_put(int32_t nr,const char *data,ssize_t cnt)
+{
+    struct iovec iov[2 * BUILD_BATCH];
+    int32_t nrs[BUILD_BATCH];
+    ssize_t i,len = 0;
+
+    for(i = 0;i < cnt;i++) {
+        nrs[i] = nr + i;
+        iov[2 * i].iov_base = &nrs[i];
+        iov[2 * i].iov_len = sizeof(int32_t);
+        iov[2 * i + 1].iov_base = (char *)data + i * BLOCK_SIZE;
+        iov[2 * i + 1].iov_len = BLOCK_SIZE;
+        len += sizeof(int32_t) + BLOCK_SIZE;
+    }
+    return pwritev(build_fd,iov,2 * cnt,build_off(nr)) == len ? 0 : -EIO;
+}
+
+
+//拷贝一个文件的数据，再写出它的索引块
+static int build_copy(build_file *f,char *buf,ssize_t batch)
+{
+    int32_t *p;
+    ssize_t i,j,k,got,want;
+    int fd,ret = 0;
+
+    if((fd = openat(build_src,f->name,O_RDONLY)) < 0)
+        return -errno;
+    //文件在扫描之后变短时，缺的部分当作0；变长的部分不导入
+    for(j = 0;j < f->nblocks && ret == 0;j += k) {
+        k = f->nblocks - j < batch ? f->nblocks - j : batch;
+        want = f->st.st_size - j * BLOCK_SIZE < k * BLOCK_SIZE ? f->st.st_size - j * BLOCK_SIZE : k * BLOCK_SIZE;
+        i = 0;
+        for(got = 0;got < want;got += i)
+            if((i = read(fd,buf + got,want - got)) <= 0)
+                break;
+        if(i < 0)
+            ret = -errno;
+        memset(buf + got,0,k * BLOCK_SIZE - got);
+        if(ret == 0)
+            ret = build_put(f->first + j,buf,k);
+    }
+    close(fd);
+    if(ret < 0 || f->nindex == 0)
+        return ret;
+
+    //索引块依次是：一级索引块，二级索引的根，二级索引的各个叶子
+    p = (int32_t *)buf;
+    memset(buf,0,BLOCK_SIZE);
+    for(j = BLOCKS_INODE;j < f->nblocks && j < TBLOCK;j++)
+        p[j - BLOCKS_INODE] = f->first + j;
+    ret = build_put(f->first + f->nblocks,buf,1);
+    if(f->nindex == 1 || ret < 0)
+        return ret;
+    memset(buf,0,BLOCK_SIZE);
+    for(i = 0;i < f->nindex - 2;i++)
+        p[i] = f->first + f->nblocks + 2 + i;
+    ret = build_put(f->first + f->nblocks + 1,buf,1);
+    for(i = 0;i < f->nindex - 2 && ret == 0;i++) {
+        memset(buf,0,BLOCK_SIZE);
+        for(k = 0;k < PTRS_BLOCK && (j = TBLOCK + (i << PTR_SHIFT) + k) < f->nblocks;k++)
+            p[k] = f->first + j;
+        ret = build_put(f->first + f->nblocks + 2 + i,buf,1);
+    }
+    return ret;
+}
+
+
+static void *build_worker(void *arg)
+{
+    ssize_t batch = BUILD_CHUNK >> blk_shift;
+    char *buf;
+    int i,ret;
+
+    if(batch < 1)
+        batch = 1;
+    if(batch > BUILD_BATCH)
+        batch = BUILD_BATCH;
+    buf = malloc(batch * BLOCK_SIZE);
+    while((i = __sync_fetch_and_add(&build_next,1)) < build_nfiles) {
+        if((ret = build_copy(&build_files[i],buf,batch)) < 0) {
+            fprintf(stderr,"build: %s: %s\n",build_files[i].name,strerror(-ret));
+            __sync_fetch_and_add(&build_errors,1);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+
+static int build_cmp(const void *a,const void *b)
+{
+    return strcmp(((const build_file *)a)->name,((const build_file *)b)->name);
+}
+
+
+//扫描SRC，按文件名排序后依次划分连续的块
+static int build_scan(DIR *dir,ssize_t *total)
+{
+    struct dirent *d;
+    build_file *f;
+    ssize_t next = 2;
+    int cap = 0;
+
+    build_src = dirfd(dir);
+    while((d = readdir(dir)) != NULL) {
+        if(build_nfiles == cap) {
+            cap = cap ? cap * 2 : 256;
+            build_files = realloc(build_files,cap * sizeof(build_file));
+        }
+        f = &build_files[build_nfiles];
+        if(fstatat(build_src,d->d_name,&f->st,AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(f->st.st_mode)) {
+            if(strcmp(d->d_name,".") != 0 && strcmp(d->d_name,"..") != 0)
+                fprintf(stderr,"build: skipping %s: not a regular file\n",d->d_name);
+            continue;
+        }
+        if(strlen(d->d_name) >= MAX_FILENAME || strcmp(d->d_name,STATS_PATH + 1) == 0 ||
+           strcmp(d->d_name,QUERY_PATH + 1) == 0) {
+            fprintf(stderr,"build: skipping %s: bad name\n",d->d_name);
+            continue;
+        }
+        f->name = strdup(d->d_name);
+        f->nblocks = (f->st.st_size + BLOCK_MASK) >> blk_shift;
+        if(f->nblocks > TBLOCK + (PTRS_BLOCK << PTR_SHIFT)) {
+            fprintf(stderr,"build: %s: file too large\n",f->name);
+            return -EFBIG;
+        }
+        build_nfiles++;
+    }
+    qsort(build_files,build_nfiles,sizeof(build_file),build_cmp);
+    if(build_nfiles >= INODENUM) {
+        fprintf(stderr,"build: %d files, at most %d fit\n",build_nfiles,INODENUM - 1);
+        return -ENOSPC;
+    }
+    for(f = build_files;f < build_files + build_nfiles;f++) {
+        f->nindex = build_index_blocks(f->nblocks);
+        f->first = next < BLOCKNUM ? next : 0;
+        next += f->nblocks + f->nindex;
+    }
+    *total = next - 2;
+    if(next > BLOCKNUM) {
+        fprintf(stderr,"build: %zd blocks needed, only %d fit\n",*total,BLOCKNUM - 2);
+        return -ENOSPC;
+    }
+    return 0;
+}
+
+
+//-o build=SRC：把SRC导入为options.checkpoint处的基础镜像，不挂载
+static int build_image(const char *src)
+{
+    char path[PATH_MAX],tmp[PATH_MAX + 8];
+    char *sb_buf,*bitmap;
+    int32_t *ibitmap;
+    SuperBlock *sb;
+    ckpt_header h;
+    ckpt_inode ci;
+    ckpt_dent cd;
+    build_file *f;
+    pthread_t *tid;
+    struct timespec t0,t1;
+    ssize_t total,n,j;
+    double secs;
+    int i,nthreads,ret;
+    FILE *out;
+    DIR *dir;
+
+    if(options.checkpoint == NULL) {
+        fprintf(stderr,"build: needs -o checkpoint=IMAGE\n");
+        return -EINVAL;
+    }
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    if((dir = opendir(src)) == NULL) {
+        ret = -errno;
+        perror(src);
+        return ret;
+    }
+    if((ret = build_scan(dir,&total)) < 0) {
+        closedir(dir);
+        return ret;
+    }
+
+    //superblock、inode位图和block位图与init之后再分配同样多的块得到的一样
+    sb_buf = calloc(1,SUPER_SIZE);
+    bitmap = calloc(1,BITMAP_SIZE);
+    sb = (SuperBlock *)sb_buf;
+    sb->blocksize = BLOCK_SIZE;
+    sb->inodesize = INODE_SIZE;
+    sb->sum_inodes = MAX_FILENUM;
+    sb->sum_blocknr = BLOCKNUM;
+    sb->free_inodes = MAX_FILENUM - 1 - build_nfiles;
+    sb->free_blocknr = BLOCKNUM - 2 - total;
+    sb->first_inode = 1;
+    sb->first_data = 2;
+    ibitmap = (int32_t *)(sb_buf + 1024);
+    for(i = 0;i <= build_nfiles;i++)
+        ibitmap[i / 32] |= 1U << (i % 32);
+    for(n = 0;n < total + 2;n++)
+        ((int32_t *)bitmap)[n / 32] |= 1U << (n % 32);
+
+    memset(&h,0,sizeof(h));
+    memcpy(h.magic,CKPT_MAGIC,8);
+    h.blocksize = BLOCK_SIZE;
+    h.blocknum = BLOCKNUM;
+    h.inodenum = INODENUM;
+    h.gen = 1;
+    h.meta = 1;
+    h.names = 1;
+    h.ninodes = build_nfiles;
+    h.ndents = build_nfiles;
+    h.nblocks = total;
+
+    snprintf(tmp,sizeof(tmp),"%s.tmp",options.checkpoint);
+    if((out = fopen(tmp,"w")) == NULL) {
+        ret = -errno;
+        perror(tmp);
+        closedir(dir);
+        return ret;
+    }
+    fwrite(&h,sizeof(h),1,out);
+    fwrite(sb_buf,SUPER_SIZE,1,out);
+    fwrite(bitmap,BITMAP_SIZE,1,out);
+    free(sb_buf);
+    free(bitmap);
+    for(i = 0;i < build_nfiles;i++) {
+        f = &build_files[i];
+        memset(&ci,0,sizeof(ci));
+        ci.ino = i + 1;
+        ci.used = 1;
+        n = f->first + f->nblocks;
+        for(j = 0;j < BLOCKS_INODE && j < f->nblocks;j++)
+            ci.blnum[j] = f->first + j;
+        ci.bindirect = f->nindex > 0 ? n : 0;
+        ci.tindirect = f->nindex > 1 ? n + 1 : 0;
+        ci.last_block = f->nblocks + f->nindex > 0 ? n + f->nindex - 1 : 0;
+        ci.st.st_ino = i + 1;
+        ci.st.st_mode = S_IFREG | (f->st.st_mode & 07777);
+        ci.st.st_nlink = 1;
+        ci.st.st_uid = f->st.st_uid;
+        ci.st.st_gid = f->st.st_gid;
+        ci.st.st_size = f->st.st_size;
+        ci.st.st_blksize = BLOCK_SIZE;
+        ci.st.st_blocks = f->nblocks;
+        fwrite(&ci,sizeof(ci),1,out);
+    }
+    for(i = 0;i < build_nfiles;i++) {
+        cd.ino = i + 1;
+        cd.len = strlen(build_files[i].name);
+        fwrite(&cd,sizeof(cd),1,out);
+        fwrite(build_files[i].name,cd.len,1,out);
+    }
+    if(fflush(out) != 0) {
+        build_errors++;
+        perror(tmp);
+    }
+    build_fd = fileno(out);
+    build_base = ftello(out);
+
+    //块记录的位置都已确定，各线程直接写到自己的位置上
+    nthreads = options.build_threads ? options.build_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads < 1)
+        nthreads = 1;
+    tid = malloc(nthreads * sizeof(pthread_t));
+    for(i = 0;i < nthreads;i++)
+        pthread_create(&tid[i],NULL,build_worker,NULL);
+    for(i = 0;i < nthreads;i++)
+        pthread_join(tid[i],NULL);
+    free(tid);
+    closedir(dir);
+
+    if(build_errors == 0 && fsync(build_fd) != 0) {
+        build_errors++;
+        perror(tmp);
+    }
+    fclose(out);
+    if(build_errors > 0) {
+        unlink(tmp);
+        return -EIO;
+    }
+    //旧镜像的增量和日志不能叠加在新镜像上
+    for(i = 1;;i++) {
+        snprintf(path,sizeof(path),"%s.%d",options.checkpoint,i);
+        if(unlink(path) != 0)
+            break;
+    }
+    snprintf(path,sizeof(path),"%s.journal",options.checkpoint);
+    unlink(path);
+    if(rename(tmp,options.checkpoint) != 0) {
+        ret = -errno;
+        perror(options.checkpoint);
+        return ret;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    secs = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr,"build: %d files, %zd blocks of %zd bytes, %.1f MiB in %.2f s (%.1f MiB/s, %d threads)\n",
+            build_nfiles,total,BLOCK_SIZE,(double)total * BLOCK_SIZE / (1 << 20),secs,
+            (double)total * BLOCK_SIZE / (1 << 20) / secs,nthreads);
+    return 0;
+}
+
+
+//按租户（uid）公平调度：每个租户同时执行的读写请求数不超过它按权重分到的名额，
+//名额总数为fair_slots，只有一个租户在读写时它可以用满；超出的请求按到达顺序排队
+//没有读写请求在执行的租户至少分到一个名额，所以不会排在别人的大块读写后面；元数据请求不排队
+//每个租户分别记录元数据和读写请求的延迟（含排队时间），统计文件中给出p99
+enum {
+    FAIR_META,                  //元数据请求：getattr、readdir、open、创建删除等
+    FAIR_DATA,                  //读写请求：read、write以及要写回数据的truncate、fsync
+    FAIR_CLASSES,
+};
+
+typedef struct fair_waiter {
+    sem_t sem;
+    struct fair_waiter *next;
+} fair_waiter;
+
+typedef struct {
+    uid_t uid;
+    int used;
+    unsigned weight;
+    int busy;                       //正在执行的读写请求数
+    int queued;                     //排队中的读写请求数
+    fair_waiter *head,*tail;        //排队中的读写请求
+    uint64_t lat[FAIR_CLASSES][LAT_BUCKETS];    //延迟直方图
+    uint64_t ops[FAIR_CLASSES];
+} tenant;
+
+//一个请求从进入调度到完成的记录
+typedef struct {
+    tenant *t;
+    int cls;
+    long long t0;
+} fair_req;
+
+static tenant tenants[FAIR_TENANTS];
+static pthread_mutex_t fair_lock = PTHREAD_MUTEX_INITIALIZER;
+static int fair_slots;              //所有租户同时执行的读写请求数
+static unsigned fair_weights_sum;   //有读写请求在执行或排队的租户的权重之和
+static int fair_waiting;            //所有租户排队中的读写请求数
+static uint64_t fair_delayed;       //排过队的读写请求数
+
+
+static long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+//uid在fair_weights中的权重，没有列出的为1
+static unsigned fair_weight(uid_t uid)
+{
+    const char *s = options.fair_weights;
+    unsigned u,w;
+    int k;
+
+    while(s != NULL && sscanf(s,"%u:%u%n",&u,&w,&k) == 2) {
+        if(u == uid)
+            return w > 0 ? w : 1;
+        s = strchr(s + k,',');
+        if(s != NULL)
+            s++;
+    }
+    return 1;
+}
+
+
+//uid对应的租户，第一次出现时分配；租户数超过FAIR_TENANTS时后来的uid共用一个
+static tenant *fair_tenant(uid_t uid)
+{
+    int i,k,h = uid % FAIR_TENANTS;
+
+    //已有的租户不加锁就能找到
+    for(i = 0;i < FAIR_TENANTS;i++) {
+        k = (h + i) % FAIR_TENANTS;
+        if(!__atomic_load_n(&tenants[k].used,__ATOMIC_ACQUIRE))
+            break;
+        if(tenants[k].uid == uid)
+            return &tenants[k];
+    }
+    pthread_mutex_lock(&fair_lock);
+    for(i = 0;i < FAIR_TENANTS;i++) {
+        k = (h + i) % FAIR_TENANTS;
+        if(!tenants[k].used) {
+            tenants[k].uid = uid;
+            tenants[k].weight = fair_weight(uid);
+            __atomic_store_n(&tenants[k].used,1,__ATOMIC_RELEASE);
+            break;
+        }
+        if(tenants[k].uid == uid)
+            break;
+    }
+    pthread_mutex_unlock(&fair_lock);
+    return &tenants[i < FAIR_TENANTS ? k : h];
+}
+
+
+//租户t还能不能再开始一个读写请求，调用时持有fair_lock
+static int fair_admit(tenant *t)
+{
+    unsigned share = fair_slots * t->weight / fair_weights_sum;
+
+    return t->busy < (share > 0 ? share : 1);
+}
+
+
+//延迟ns所在的直方图格子：每个2的幂分成4格
+static int lat_bucket(long long ns)
+{
+    int e;
+
+    if(ns < 4)
+        return ns < 0 ? 0 : ns;
+    e = 63 - __builtin_clzll(ns);
+    if(e >= LAT_BUCKETS / 4)
+        return LAT_BUCKETS - 1;
+    return e * 4 + ((ns >> (e - 2)) & 3);
+}
+
+
+//直方图的p99，取所在格子的上界，单位us
+static double lat_p99(const uint64_t *lat)
+{
+    uint64_t total = 0,seen = 0;
+    int b,e;
+
+    for(b = 0;b < LAT_BUCKETS;b++)
+        total += lat[b];
+    if(total == 0)
+        return 0;
+    for(b = 0;b < LAT_BUCKETS;b++) {
+        seen += lat[b];
+        if(seen * 100 >= total * 99)
+            break;
+    }
+    if(b < 4)
+        return (b + 1) / 1000.0;
+    e = b / 4;
+    return (double)((4 + b % 4 + 1LL) << (e - 2)) / 1000.0;
+}
+
+
+//请求开始：读写请求超出租户的名额时排队；元数据请求直接执行
+static void fair_begin(fair_req *q,int cls)
+{
+    tenant *t;
+    fair_waiter w;
+
+    q->t0 = now_ns();
+    q->t = t = fair_tenant(fuse_get_context()->uid);
+    q->cls = cls;
+    if(cls != FAIR_DATA)
+        return;
+    pthread_mutex_lock(&fair_lock);
+    if(t->busy + t->queued == 0)
+        fair_weights_sum += t->weight;
+    if(t->queued == 0 && fair_admit(t)) {
+        t->busy++;
+        pthread_mutex_unlock(&fair_lock);
+        return;
+    }
+    w.next = NULL;
+    sem_init(&w.sem,0,0);
+    if(t->tail)
+        t->tail->next = &w;
+    else
+        t->head = &w;
+    t->tail = &w;
+    t->queued++;
+    fair_waiting++;
+    fair_delayed++;
+    pthread_mutex_unlock(&fair_lock);
+    while(sem_wait(&w.sem) != 0)
+        ;
+    sem_destroy(&w.sem);
+}
+
+
+//请求结束：记下延迟；读写请求让出名额，放行名额还没用完的租户的排队请求
+static void fair_end(fair_req *q)
+{
+    tenant *t = q->t;
+    fair_waiter *w,*granted = NULL;
+    int i;
+
+    if(q->cls == FAIR_DATA) {
+        pthread_mutex_lock(&fair_lock);
+        t->busy--;
+        if(t->busy + t->queued == 0)
+            fair_weights_sum -= t->weight;
+        //租户空闲下来时其他租户的名额变多，可能不止放行一个
+        for(i = 0;i < FAIR_TENANTS && fair_waiting > 0;i++) {
+            t = &tenants[i];
+            while(t->head != NULL && fair_admit(t)) {
+                w = t->head;
+                if((t->head = w->next) == NULL)
+                    t->tail = NULL;
+                t->queued--;
+                fair_waiting--;
+                t->busy++;
+                w->next = granted;
+                granted = w;
+            }
+        }
+        pthread_mutex_unlock(&fair_lock);
+        //放开锁之后再唤醒，被唤醒的线程不用再等这把锁
+        while(granted != NULL) {
+            w = granted;
+            granted = w->next;
+            sem_post(&w->sem);
+        }
+    }
+    __sync_fetch_and_add(&q->t->lat[q->cls][lat_bucket(now_ns() - q->t0)],1);
+    __sync_fetch_and_add(&q->t->ops[q->cls],1);
+}
+
+
+static void *oshfs_init(struct fuse_conn_info *conn)
+{
+    int i,size;
+    pthread_t tid;
+
+    //块大小在分配任何块之前定下来：检查点中的块号和块内偏移都是按它记录的
+    if(options.checkpoint && (size = image_blocksize()) > 0 && size != BLOCK_SIZE) {
+        if(block_shift_of(size) < 0) {
+            fprintf(stderr,"checkpoint %s: bad block size %d\n",options.checkpoint,size);
+            exit(1);
+        }
+        fprintf(stderr,"checkpoint %s: using its block size %d\n",options.checkpoint,size);
+        blk_shift = block_shift_of(size);
+    }
+
+    mem[0] = mmap(NULL, SUPER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    mem[1] = mmap(NULL, BITMAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	node[0] = mmap(NULL,INODE_SIZE,PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    block_bitmap = (int32_t *)mem[1];
+    inode_bitmap = (int32_t *)(mem[0]+1024);
+    memset(inode_bitmap,0,INODENUM / 32 * sizeof(int32_t));
+    memset(block_bitmap,0,BLOCKNUM / 32 * sizeof(int32_t));
+    //superblock的初始化以及root的初始化
+	super = (SuperBlock *)mem[0];
+	super->blocksize = BLOCK_SIZE;
+	super->inodesize = INODE_SIZE;
+	super->sum_inodes = MAX_FILENUM;
+	super->sum_blocknr = BLOCKNUM;
+	super->free_inodes = MAX_FILENUM - 1;
+	super->free_blocknr = BLOCKNUM - 2;
+	super->first_inode = 1;
+	super->first_data = 2;
+
+    root = (inode *)node[0];
+	root->st = &attr[0];
+    //blnum[]中的值为0 意味着无效
+    for(i = 0;i<BLOCKS_INODE; i++)
+        root->blnum[i] = 0;
+    root->bindirect = 0;
+    root->tindirect = 0;
+    root->last_block = 0;
+    root->st->st_ino = 0;
+	root->st->st_uid = getuid();
+    root->st->st_mode = S_IFDIR | 0755;
+    root->st->st_gid = getgid();
+    root->st->st_blksize = BLOCK_SIZE;
+    root->st->st_blocks = 0;
+    root->st->st_size = 0;
+
+    block_bitmap[0] = 3;
+    inode_bitmap[0] = 1;
+
+    //初始化块组，0号组中的superblock和位图块已被占用
+    for(i = 0;i < GROUPNUM;i++) {
+        pthread_mutex_init(&groups[i].lock,NULL);
+        groups[i].first = i * GROUP_BLOCKS;
+        groups[i].bitmap = block_bitmap + groups[i].first / 32;
+        groups[i].free = GROUP_BLOCKS;
+    }
+    groups[0].free -= 2;
+
+    //启用校验和：要在恢复检查点之前准备好，恢复出的块要算校验和
+    if(options.checksum) {
+        crc_init();
+        block_sum = (uint64_t *)calloc(BLOCKNUM,sizeof(uint64_t));
+        for(i = 0;i < SUM_LOCKS;i++)
+            pthread_mutex_init(&sum_lock[i],NULL);
+    }
+
+    //启用分层存储：先打开spill文件，从检查点恢复出的块也按预算换出
+    if(options.spill) {
+        spill_fd = open(options.spill, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if(spill_fd < 0)
+            perror(options.spill);
+        else {
+            resident_budget = options.mem_budget ? (options.mem_budget >> blk_shift) : BLOCKNUM / 4;
+            if(resident_budget < 64)
+                resident_budget = 64;
+            mem_locking = 1;
+        }
+    }
+
+    //启用检查点：从已有的检查点恢复，启动检查点线程
+    if(options.checkpoint) {
+        ckpt_restore();
+        if(options.journal) {
+            char path[PATH_MAX];
+            jheader h;
+
+            //日志中已有的记录要保留到下一次检查点，新记录追加在后面
+            snprintf(path,sizeof(path),"%s.journal",options.checkpoint);
+            journal_fd = open(path, O_RDWR | O_CREAT, 0600);
+            if(journal_fd < 0)
+                perror(path);
+            else if((jfile_off = lseek(journal_fd,0,SEEK_END)) == 0) {
+                memcpy(h.magic,JOURNAL_MAGIC,8);
+                h.gen = ckpt_gen;
+                h.seq = ckpt_seq;
+                h.blocksize = BLOCK_SIZE;
+                if(write(journal_fd,&h,sizeof(h)) != sizeof(h))
+                    perror(path);
+                jfile_off = sizeof(h);
+            }
+        }
+        mem_locking = 1;
+        sem_init(&ckpt_sem,0,0);
+        signal(SIGUSR1,ckpt_signal);
+        pthread_create(&tid,NULL,ckpt_worker,NULL);
+        pthread_detach(tid);
+    }
+
+    //让内核发大的读写请求，减少用户态和内核态之间的往返
+    conn->want |= FUSE_CAP_BIG_WRITES | FUSE_CAP_ASYNC_READ;
+    if(!options.nosplice)
+        conn->want |= (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE) & conn->capable;
+    conn->async_read = 1;
+    conn->max_write = options.max_write;
+    conn->max_readahead = options.max_readahead;
+    conn->max_background = options.max_background;
+
+    //启动换出线程
+    if(spill_fd >= 0) {
+        pthread_create(&tid,NULL,tier_worker,NULL);
+        pthread_detach(tid);
+    }
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    //libfuse支持时，kcache模式下让内核先缓存写再批量写回
+    if(options.kcache)
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE & conn->capable;
+#endif
+
+    //整理线程搬块时要挡住读写请求，需要mem_lock
+    if(options.defrag && options.defrag_rate > 0) {
+        mem_locking = 1;
+        pthread_create(&tid,NULL,defrag_worker,NULL);
+        pthread_detach(tid);
+    }
+    //公平调度默认每个CPU同时执行一个读写请求
+    fair_slots = options.fair_slots ? options.fair_slots : sysconf(_SC_NPROCESSORS_ONLN);
+    if(fair_slots < 1)
+        fair_slots = 1;
+    if(block_sum && options.scrub_rate > 0) {
+        pthread_create(&tid,NULL,scrub_worker,NULL);
+        pthread_detach(tid);
+    }
+    //启动后台回收线程
+    pthread_create(&tid,NULL,reclaim_worker,NULL);
+    pthread_detach(tid);
+    return NULL;
+}
+
+
+//生成统计信息文件的内容，返回其长度
+static int stats_text(char *buf,size_t size)
+{
+    int len,i;
+    tenant *t;
+    double avg_run;
+    ssize_t free_largest,free_runs;
+
+    //扫描期间文件不能被删除，块映射不能被搬动
+    pthread_mutex_lock(&dir_lock);
+    mem_rdlock();
+    frag_report(&avg_run,&free_largest,&free_runs);
+    mem_unlock();
+    pthread_mutex_unlock(&dir_lock);
+
+    len = snprintf(buf,size,
+                   "block_size %zd\n"
+                   "blocks_total %zd\n"
+                   "blocks_free %zd\n"
+                   "inodes_free %d\n",
+                   BLOCK_SIZE,(ssize_t)super->sum_blocknr,count_free_blocks(),super->free_inodes);
+    if(options.checkpoint)
+        len += snprintf(buf + len,size - len,
+                        "checkpoint_gen %d\n"
+                        "checkpoint_deltas %d\n"
+                        "checkpoint_last_blocks %zd\n",
+                        ckpt_gen,ckpt_seq,ckpt_last_blocks);
+    if(journal_fd >= 0)
+        len += snprintf(buf + len,size - len,
+                        "journal_bytes %" PRIu64 "\n"
+                        "journal_commits %" PRIu64 "\n"
+                        "journal_syncs %" PRIu64 "\n",
+                        jlsn,jcommits,jsyncs);
+    if(spill_fd >= 0) {
+        ssize_t hits = 0,misses = 0;
+
+        for(i = 0;i < TIER_STRIPES;i++) {
+            hits += __atomic_load_n(&tier_stripes[i].hits,__ATOMIC_RELAXED);
+            misses += __atomic_load_n(&tier_stripes[i].misses,__ATOMIC_RELAXED);
+        }
+        len += snprintf(buf + len,size - len,
+                        "tier_budget %zd\n"
+                        "tier_resident %zd\n"
+                        "tier_hits %zd\n"
+                        "tier_misses %zd\n"
+                        "tier_evictions %zd\n",
+                        resident_budget,__atomic_load_n(&resident,__ATOMIC_RELAXED),hits,misses,
+                        __atomic_load_n(&tier_evictions,__ATOMIC_RELAXED));
+    }
+    len += snprintf(buf + len,size - len,
+                    "frag_avg_run %.1f\n"
+                    "frag_free_largest %zd\n"
+                    "frag_free_runs %zd\n",
+                    avg_run,free_largest,free_runs);
+    if(options.defrag)
+        len += snprintf(buf + len,size - len,
+                        "defrag_files %zd\n"
+                        "defrag_moved %zd\n",
+                        defrag_files,defrag_moved);
+    if(block_sum)
+        len += snprintf(buf + len,size - len,
+                        "checksum_hw %d\n"
+                        "checksum_errors %zd\n"
+                        "scrub_blocks %zd\n"
+                        "scrub_passes %zd\n",
+                        crc_hw,sum_errors,scrub_blocks,scrub_passes);
+    len += snprintf(buf + len,size - len,
+                    "xattr_blocks %d\n"
+                    "xattr_fast_misses %zd\n"
+                    "query_count %zd\n"
+                    "query_scanned %zd\n",
+                    xattr_nshared,xattr_fast,query_count,query_scanned);
+    if(options.fair)
+        len += snprintf(buf + len,size - len,"fair_delayed %" PRIu64 "\n",fair_delayed);
+    //每个租户一行，放不下的租户不再列出
+    for(i = 0;i < FAIR_TENANTS && options.fair && len + 128 < size;i++) {
+        t = &tenants[i];
+        if(!__atomic_load_n(&t->used,__ATOMIC_ACQUIRE))
+            continue;
+        len += snprintf(buf + len,size - len,
+                        "tenant %u weight %u meta_ops %" PRIu64 " meta_p99_us %.1f data_ops %" PRIu64 " data_p99_us %.1f\n",
+                        (unsigned)t->uid,t->weight,t->ops[FAIR_META],lat_p99(t->lat[FAIR_META]),
+                        t->ops[FAIR_DATA],lat_p99(t->lat[FAIR_DATA]));
+    }
+    return len;
+}
+
+
+static int oshfs_getattr(const char *path, struct stat *stbuf)
+{
+    int ret = 0;
+    int d = lookup(path);
+    int ino = d > 0 ? dent_ino[d] : 0;
+
+    if(strcmp(path, "/") == 0) {
+        memset(stbuf, 0, sizeof(struct stat));
+        stbuf->st_mode = S_IFDIR | 0755;
+    } else if(strcmp(path, STATS_PATH) == 0) {
+        char text[STATS_SIZE];
+
+        memset(stbuf, 0, sizeof(struct stat));
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = stats_text(text,sizeof(text));
+    } else if(query_dir(path)) {
+        //查询目录中的模式不用事先创建，任何模式都是一个目录，readdir时才按它列出文件
+        memset(stbuf, 0, sizeof(struct stat));
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+    } else if(ino > 0) {
+        //原因同上
+        stbuf->st_ino = attr[ino].st_ino;
+        stbuf->st_mode = attr[ino].st_mode;
+        stbuf->st_nlink = attr[ino].st_nlink;
+        stbuf->st_uid = attr[ino].st_uid;
+        stbuf->st_gid = attr[ino].st_gid;
+        stbuf->st_size = file_size(ino);
+        stbuf->st_blksize = attr[ino].st_blksize;
+        stbuf->st_blocks = attr[ino].st_blocks;
+    } else {
+        ret = -ENOENT;
+    }
+    return ret;
+}
+
+
+static int oshfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+    struct stat *p_st;
+    const char *q = query_pattern(path);
+    int d;
+
+    if(q != NULL && strchr(q,'/') != NULL)
+        return -ENOTDIR;
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    if(q != NULL) {
+        query_readdir(q,buf,filler);
+        return 0;
+    }
+    if(strcmp(path,QUERY_PATH) == 0)
+        return 0;
+    //malloc一个p_st是为了满足filler函数参数中必须是struct stat的要求
+    p_st = (struct stat *)malloc(sizeof(struct stat));
+    //按目录项号顺序扫描
+    for(d = 1;d < DENTNUM;d++) {
+        if(__atomic_load_n(&name_hash[d],__ATOMIC_ACQUIRE) == 0)
+            continue;
+        dent_stat(d,p_st);
+        filler(buf,name_ptr[d],p_st,0);
+    }
+    free(p_st);
+    return 0;
+}
+
+
+static int oshfs_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    int ret;
+    struct stat st;
+    st.st_mode = S_IFREG | 0644;
+    st.st_uid = fuse_get_context()->uid;
+    st.st_gid = fuse_get_context()->gid;
+    st.st_nlink = 1;
+    st.st_size = 0;
+    st.st_blksize = BLOCK_SIZE;
+    if((ret = name_reserved(path)) < 0)
+        return ret;
+    pthread_mutex_lock(&dir_lock);
+    if(lookup(path) > 0)
+        ret = -EEXIST;
+    else {
+        mem_rdlock();
+        ret = create_inode(path + 1, &st);
+        mem_unlock();
+    }
+    pthread_mutex_unlock(&dir_lock);
+    if(journal_done() < 0)
+        ret = -EIO;
+    return ret;
+}
+
+
+static int oshfs_open(const char *path, struct fuse_file_info *fi)
+{
+    struct inode *node = get_inode(path);
+
+    if(strcmp(path, STATS_PATH) == 0) {
+        //统计信息每次读都重新生成，不能被内核缓存
+        if((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        fi->direct_io = 1;
+        return 0;
+    }
+    if(node == NULL)
+        return -ENOENT;
+    if(query_ro(path) && ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)))
+        return -EROFS;
+    fi->fh |= (uint64_t)node->st->st_ino << FH_INO_SHIFT;
+    fi->fh |= (uint64_t)__atomic_load_n(&inode_gen[node->st->st_ino],__ATOMIC_ACQUIRE) << FH_GEN_SHIFT;
+    //一次性读写的大文件绕过内核页缓存，数据只在mem[]里保存一份
+    if(options.direct_io || (options.direct_io_threshold &&
+                             node->st->st_size >= options.direct_io_threshold)) {
+        fi->direct_io = 1;
+        fi->fh |= FH_STREAM;
+    }
+    else if(options.kcache && (node->st->st_nlink > 1 || query_pattern(path) != NULL))
+        //硬链接的每个名字以及QUERY_PATH下的别名在内核中是不同的inode，各有各的页缓存，
+        //经一个名字写入不会让另一个名字的缓存失效，所以不经过页缓存
+        fi->direct_io = 1;
+    else if(options.kcache)
+        //所有修改都经过内核到达本进程，内核的页缓存始终是最新的，
+        //因此打开文件时不必丢弃它
+        fi->keep_cache = 1;
+    return 0;
+}
+
+
+//取得打开的文件的inode：open时已把inode号和代数记在fi->fh中，读写不必再按路径查找
+//文件删除后inode号可能已分给别的文件，代数不同时返回0，和按路径找不到一样
+static int file_ino(const char *path,struct fuse_file_info *fi)
+{
+    int ino = fi ? (fi->fh >> FH_INO_SHIFT) & FH_INO_MASK : 0;
+    int d;
+
+    if(ino > 0 && ino < INODENUM)
+        return node[ino] != NULL &&
+               __atomic_load_n(&inode_gen[ino],__ATOMIC_ACQUIRE) == (uint32_t)(fi->fh >> FH_GEN_SHIFT) ? ino : 0;
+    d = lookup(path);
+    return d > 0 ? dent_ino[d] : 0;
+}
+
+
+static struct inode *ino_inode(int ino)
+{
+    return ino > 0 ? (inode *)node[ino] : NULL;
+}
+
+
+static struct inode *file_inode(const char *path,struct fuse_file_info *fi)
+{
+    return ino_inode(file_ino(path,fi));
+}
+
+
+//不经过CPU缓存的拷贝：用non-temporal store写目标，
+//一次性扫过的大文件不会把其他数据挤出缓存
+static void stream_copy(char *dst,const char *src,size_t len)
+{
+#ifdef __SSE2__
+    size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+
+    if(len < 256 || head >= len) {
+        memcpy(dst,src,len);
+        return;
+    }
+    memcpy(dst,src,head);
+    dst += head;
+    src += head;
+    len -= head;
+    while(len >= 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst,a);
+        _mm_stream_si128((__m128i *)(dst + 16),b);
+        _mm_stream_si128((__m128i *)(dst + 32),c);
+        _mm_stream_si128((__m128i *)(dst + 48),d);
+        src += 64;
+        dst += 64;
+        len -= 64;
+    }
+    _mm_sfence();
+#endif
+    memcpy(dst,src,len);
+}
+
+
+//找到第j个block的号码，若还未分配则分配它（以及所需的索引块）
+static ssize_t map_block(inode *node,ssize_t j)
+{
+    int a;
+    ssize_t k,n;
+    int32_t *p,*add;
+
+    if(j >= BLOCKS_INODE && node->bindirect == 0) {
+        //分配一级索引
+        if((k = malloc_block(node)) < 0)
+            return k;
+        node->bindirect = k;
+        node->st->st_blocks--;
+        journal_append(J_INDEX,node->st->st_ino,1,0,k,NULL,0);
+    }
+
+    if(j >= TBLOCK) {
+        //分配二级索引
+        if(node->tindirect == 0) {
+            //分配一个存储block号码的block
+            if((k = malloc_block(node)) < 0)
+                return k;
+            node->tindirect = k;
+            node->st->st_blocks--;
+            memset(blk(node->tindirect),0,BLOCK_SIZE);
+            journal_append(J_INDEX,node->st->st_ino,2,0,k,NULL,0);
+        }
+        a = (j - TBLOCK) >> PTR_SHIFT;
+        p = (int32_t *)blk(node->tindirect);
+        //分配二级索引中的第二级索引块
+        if(*(p + a) == 0) {
+            if((k = malloc_block(node)) < 0)
+                return k;
+            *(p + a) = k;
+            node->st->st_blocks--;
+            memset(blk(k),0,BLOCK_SIZE);
+            journal_append(J_INDEX,node->st->st_ino,3,a,k,NULL,0);
+        }
+    }
+
+    n = lookforblnum(node,j,&add);
+    if(n == 0) {
+        // 若指向的block未分配
+        if((n = malloc_block(node)) < 0)
+            return n;
+        *add = n;
+        journal_append(J_MAP,node->st->st_ino,j,n,0,NULL,0);
+        //记下存放块号的地方被改过：inode本身或者索引块
+        DIRTY_INODE(node->st->st_ino);
+        if(j >= TBLOCK) {
+            DIRTY_BLOCK(node->tindirect);
+            DIRTY_BLOCK(((int32_t *)blk(node->tindirect))[(j - TBLOCK) >> PTR_SHIFT]);
+        }
+        else if(j >= BLOCKS_INODE)
+            DIRTY_BLOCK(node->bindirect);
+    }
+    return n;
+}
+
+
+//把buf写到文件的offset处，返回写入的字节数或错误码
+static int write_inode(inode *node,const char *buf,size_t size,off_t offset,int stream)
+{
+    ssize_t j,n;
+    size_t off,len,done = 0;
+    char *p;
+
+    mem_rdlock();
+    //逐块拷贝：第一个块从块内偏移off开始，之后每块都从头开始
+    while(done < size) {
+        j = (offset + done) >> blk_shift;           // 第j个block
+        off = (offset + done) & BLOCK_MASK;        // 块内偏移
+        len = BLOCK_SIZE - off;
+        if(len > size - done)
+            len = size - done;
+        n = map_block(node,j);
+        if(n >= 0 && (p = blk(n)) == NULL)
+            n = -EIO;
+        if(n < 0) {
+            if(done == 0) {
+                mem_unlock();
+                return n;
+            }
+            break;
+        }
+        if(block_sum)
+            sum_begin(n);
+        if(stream)
+            stream_copy(p + off,buf + done,len);
+        else
+            memcpy(p + off,buf + done,len);
+        //整块写入时用源缓冲区算CRC，它刚被读过还在缓存里
+        if(block_sum)
+            sum_end(n,len == BLOCK_SIZE ? buf + done : NULL);
+        DIRTY_BLOCK(n);
+        journal_append(J_DATA,0,n,off,len,buf + done,len);
+        done += len;
+    }
+    if(offset + done > node->st->st_size) {
+        node->st->st_size = offset + done;          // 计算文件的新的大小
+        DIRTY_INODE(node->st->st_ino);
+        journal_append(J_SIZE,node->st->st_ino,node->st->st_size,0,0,NULL,0);
+    }
+    mem_unlock();
+
+    return done;
+}
+
+
+static long long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+//把缓冲区中的数据写进块里，调用者持有w->lock
+static void wc_flush_locked(int ino,wcbuf *w)
+{
+    int ret;
+
+    if(w->len == 0)
+        return;
+    ret = write_inode((inode *)node[ino],w->data,w->len,w->off,0);
+    if(ret < (int)w->len && w->error == 0)
+        w->error = ret < 0 ? ret : -ENOSPC;
+    w->len = 0;
+}
+
+
+static void wc_flush(int ino)
+{
+    wcbuf *w = wcb[ino];
+
+    if(w == NULL || w->len == 0)
+        return;
+    pthread_mutex_lock(&w->lock);
+    wc_flush_locked(ino,w);
+    pthread_mutex_unlock(&w->lock);
+}
+
+
+//写回在缓冲区中停留超过WC_DELAY毫秒的数据
+static void *wc_worker(void *arg)
+{
+    int i;
+
+    while(1) {
+        usleep(WC_DELAY * 1000);
+        for(i = 1;i < INODENUM;i++)
+            if(wcb[i] && wcb[i]->len > 0 && now_ms() - wcb[i]->first >= WC_DELAY)
+                wc_flush(i);
+    }
+    return NULL;
+}
+
+
+static void wc_start()
+{
+    pthread_t tid;
+
+    pthread_create(&tid,NULL,wc_worker,NULL);
+    pthread_detach(tid);
+}
+
+
+static wcbuf *wc_get(int ino)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    wcbuf *w = wcb[ino];
+
+    if(w != NULL)
+        return w;
+    pthread_once(&once,wc_start);
+    w = (wcbuf *)calloc(1,sizeof(wcbuf) + WC_SIZE);
+    pthread_mutex_init(&w->lock,NULL);
+    //两个线程同时分配时只留下一个
+    if(!__sync_bool_compare_and_swap(&wcb[ino],NULL,w)) {
+        pthread_mutex_destroy(&w->lock);
+        free(w);
+    }
+    return wcb[ino];
+}
+
+
+static int oshfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    size_t k,done = 0;
+    int ino,ret;
+    wcbuf *w;
+    struct inode *node = file_inode(path,fi);
+
+    if(query_ro(path))
+        return -EROFS;
+    if(node == NULL)
+        return -ENOENT;
+    ino = node->st->st_ino;
+    //紧接在文件末尾的小写先放进写合并缓冲区，攒到块边界再一次写进块里
+    //journal_sync要求每个写返回前落盘，不合并
+    if(size < WC_SMALL && !(fi && (fi->fh & FH_STREAM)) && !options.nocoalesce && !options.journal_sync) {
+        w = wc_get(ino);
+        pthread_mutex_lock(&w->lock);
+        if(w->len > 0 ? offset == w->off + (off_t)w->len : offset == node->st->st_size) {
+            while(done < size) {
+                if(w->len == 0) {
+                    w->off = offset + done;
+                    w->cap = WC_SIZE - (w->off & BLOCK_MASK);
+                    w->first = now_ms();
+                }
+                k = w->cap - w->len < size - done ? w->cap - w->len : size - done;
+                memcpy(w->data + w->len,buf + done,k);
+                w->len += k;
+                done += k;
+                if(w->len == w->cap)
+                    wc_flush_locked(ino,w);
+            }
+            pthread_mutex_unlock(&w->lock);
+            return journal_done() < 0 ? -EIO : (int)size;
+        }
+        wc_flush_locked(ino,w);
+        pthread_mutex_unlock(&w->lock);
+    }
+    else
+        wc_flush(ino);
+    ret = write_inode(node,buf,size,offset,fi && (fi->fh & FH_STREAM));
+    if(journal_done() < 0)
+        ret = -EIO;
+
+    return ret;
+}
+
+
+static int oshfs_truncate(const char *path, off_t size)
+{
+    struct inode *node = get_inode(path);
+
+    if(query_ro(path))
+        return -EROFS;
+    if(node == NULL)
+        return -ENOENT;
+    wc_flush(node->st->st_ino);
+    mem_rdlock();
+    journal_append(J_TRUNC,node->st->st_ino,size,0,0,NULL,0);
+    truncate_inode(node,size);
+    mem_unlock();
+    return journal_done();
+}
+
+
+
+//把文件中从第j个起的PREFETCH_NUM个换出的块加入预读队列
+static void prefetch_next(inode *node,ssize_t j)
+{
+    int cnt = 0;
+    ssize_t i,n;
+    int32_t nr[PREFETCH_NUM],*add;
+
+    for(i = j;i < j + PREFETCH_NUM && i * BLOCK_SIZE < node->st->st_size;i++) {
+        n = lookforblnum(node,i,&add);
+        if(n != 0 && mem[n] == NULL)
+            nr[cnt++] = n;
+    }
+    if(cnt > 0)
+        prefetch_add(nr,cnt);
+}
+
+
+static int oshfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    ssize_t j,n;
+    size_t off,len,done;
+    int32_t *add;
+    char *p;
+    unsigned seq;
+    int ino = file_ino(path,fi);
+    struct inode *node;
+
+    if(strcmp(path, STATS_PATH) == 0) {
+        char text[STATS_SIZE];
+        int tlen = stats_text(text,sizeof(text));
+
+        if(offset >= tlen)
+            return 0;
+        if(offset + size > tlen)
+            size = tlen - offset;
+        memcpy(buf,text + offset,size);
+        return size;
+    }
+    if(ino <= 0)
+        return -ENOENT;
+    //先把写合并缓冲区中的数据写进块里，读才能看到
+    wc_flush(ino);
+
+    //不加锁地查块映射、拷贝数据，期间块映射被截断、删除或整理改过就重读
+    ebr_enter();
+retry:
+    seq = map_read_begin(ino);
+    //这期间文件被删除、inode号又分给了别的文件时代数变了
+    if(file_ino(path,fi) != ino || (node = ino_inode(ino)) == NULL) {
+        ebr_exit();
+        return -ENOENT;
+    }
+    if(offset >= node->st->st_size) {
+        ebr_exit();
+        return 0;
+    }
+    if(offset + size > node->st->st_size)
+        size = node->st->st_size - offset;
+    done = 0;
+    while(done < size) {
+        j = (offset + done) >> blk_shift;           // 第j个block
+        off = (offset + done) & BLOCK_MASK;        // 块内偏移
+        len = BLOCK_SIZE - off;
+        if(len > size - done)
+            len = size - done;
+        n = lookforblnum(node,j,&add);
+        if(n == 0) {
+            memset(buf + done,0,len);               // 未分配的块（空洞）读出来是0
+            done += len;
+            continue;
+        }
+        if(spill_fd >= 0 && mem[n] == NULL)
+            //读到换出的块，多半是顺序读冷文件，把后面几个块也异步读回
+            prefetch_next(node,j + 1);
+        if((p = blk(n)) == NULL) {
+            //块号已经被整理挪走，或者确实读不回来
+            if(map_read_retry(ino,seq))
+                goto retry;
+            ebr_exit();
+            return done ? done : -EIO;
+        }
+        if(block_sum && (options.verify > 1 || (options.verify == 1 && len == BLOCK_SIZE)) && sum_check(n,p) < 0) {
+            //块的内容坏了，不把坏数据交给应用
+            ebr_exit();
+            return done ? done : -EIO;
+        }
+        if(fi && (fi->fh & FH_STREAM))
+            stream_copy(buf + done,p + off,len);
+        else
+            memcpy(buf + done,p + off,len);
+        done += len;
+    }
+    if(map_read_retry(ino,seq))
+        goto retry;
+    ebr_exit();
+
+    return done;
+}
+
+
+static int oshfs_unlink(const char *path)
+{
+    char name[MAX_FILENAME];
+    int d;
+
+    if(query_ro(path))
+        return -EROFS;
+    pthread_mutex_lock(&dir_lock);
+    if((d = lookup(path)) <= 0) {
+        pthread_mutex_unlock(&dir_lock);
+        return -ENOENT;
+    }
+    //删除目录项，名字放回字符串池；最后一个链接被删除时块映射交给回收线程
+    memset(name,0,sizeof(name));
+    memcpy(name,name_ptr[d],name_len[d]);
+    mem_rdlock();
+    journal_append(J_UNLINK,dent_ino[d],0,0,0,name,sizeof(name));
+    unlink_dent(d);
+    mem_unlock();
+    pthread_mutex_unlock(&dir_lock);
+    return journal_done();
+}
+
+
+//硬链接：新建一个指向同一个inode的目录项，不拷贝数据
+static int oshfs_link(const char *from, const char *to)
+{
+    char name[MAX_FILENAME];
+    int d,ino,ret = 0;
+
+    if(query_ro(from))
+        return -EROFS;
+    if(strlen(to + 1) >= MAX_FILENAME)
+        return -ENAMETOOLONG;
+    if((ret = name_reserved(to)) < 0)
+        return ret;
+    pthread_mutex_lock(&dir_lock);
+    if((d = lookup(from)) <= 0)
+        ret = -ENOENT;
+    else if(lookup(to) > 0)
+        ret = -EEXIST;
+    else {
+        ino = dent_ino[d];
+        memset(name,0,sizeof(name));
+        strcpy(name,to + 1);
+        mem_rdlock();
+        if(dent_add(ino,name) < 0)
+            ret = -ENOSPC;
+        else {
+            __sync_add_and_fetch(&attr[ino].st_nlink,1);
+            DIRTY_INODE(ino);
+            journal_append(J_LINK,ino,0,0,0,name,sizeof(name));
+        }
+        mem_unlock();
+    }
+    pthread_mutex_unlock(&dir_lock);
+    if(journal_done() < 0)
+        ret = -EIO;
+    return ret;
+}
+
+
+//改名只移动目录项，与文件大小无关；目标存在时原子地替换它，被替换的文件交给回收线程
+//flags支持RENAME_NOREPLACE和RENAME_EXCHANGE，libfuse 2.x的rename不带flags，总是传0
+static int rename_file(const char *from,const char *to,unsigned flags)
+{
+    char name[2][MAX_FILENAME];
+    int a,b,ret = 0;
+
+    if((flags & RENAME_NOREPLACE) && (flags & RENAME_EXCHANGE))
+        return -EINVAL;
+    if(query_ro(from))
+        return -EROFS;
+    if(strlen(to + 1) >= MAX_FILENAME)
+        return -ENAMETOOLONG;
+    if((ret = name_reserved(to)) < 0)
+        return ret;
+    pthread_mutex_lock(&dir_lock);
+    a = lookup(from);
+    b = lookup(to);
+    if(a <= 0)
+        ret = -ENOENT;
+    else if(b > 0 && dent_ino[a] == dent_ino[b])
+        ;       //同一个inode的两个链接（包括改名为自己），什么也不做
+    else if((flags & RENAME_NOREPLACE) && b > 0)
+        ret = -EEXIST;
+    else if((flags & RENAME_EXCHANGE) && b <= 0)
+        ret = -ENOENT;
+    else {
+        if(b < 0)
+            b = 0;
+        memset(name,0,sizeof(name));
+        memcpy(name[0],name_ptr[a],name_len[a]);
+        strcpy(name[1],to + 1);
+        mem_rdlock();
+        journal_append(J_RENAME,dent_ino[a],0,flags,0,name,sizeof(name));
+        rename_dent(a,b,flags,name[1]);
+        mem_unlock();
+    }
+    pthread_mutex_unlock(&dir_lock);
+    if(journal_done() < 0)
+        ret = -EIO;
+    return ret;
+}
+
+
+static int oshfs_rename(const char *from, const char *to)
+{
+    return rename_file(from,to,0);
+}
+
+
+//根目录、统计文件和查询目录没有扩展属性
+static int xattr_none(const char *path)
+{
+    return strcmp(path,"/") == 0 || strcmp(path,STATS_PATH) == 0 || query_dir(path);
+}
+
+
+static int oshfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+    inode *p;
+    int ret;
+
+    if(query_ro(path))
+        return -EROFS;
+    pthread_mutex_lock(&dir_lock);
+    mem_rdlock();
+    if((p = get_inode(path)) != NULL)
+        ret = xattr_set(p,name,value,size,flags);
+    else
+        ret = xattr_none(path) ? -ENOTSUP : -ENOENT;
+    mem_unlock();
+    pthread_mutex_unlock(&dir_lock);
+    if(journal_done() < 0)
+        ret = -EIO;
+    return ret;
+}
+
+
+static int oshfs_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    inode *p;
+    uint32_t mask;
+    int ret;
+
+    //内核每次写文件前都要查security.capability，大多数文件一个扩展属性都没有：
+    //不加锁看一眼inode中属性名的位图，对应的位没有置上就直接返回
+    ebr_enter();
+    p = get_inode(path);
+    mask = p ? __atomic_load_n(&p->xattr.mask,__ATOMIC_ACQUIRE) : 0;
+    ebr_exit();
+    if(p == NULL)
+        return xattr_none(path) ? -ENODATA : -ENOENT;
+    if(!(mask & xattr_bit(name,strlen(name)))) {
+        xattr_fast++;
+        return -ENODATA;
+    }
+    pthread_mutex_lock(&dir_lock);
+    mem_rdlock();
+    ret = (p = get_inode(path)) != NULL ? xattr_get(p,name,value,size) : -ENOENT;
+    mem_unlock();
+    pthread_mutex_unlock(&dir_lock);
+    return ret;
+}
+
+
+static int oshfs_listxattr(const char *path, char *list, size_t size)
+{
+    inode *p;
+    int ret;
+
+    pthread_mutex_lock(&dir_lock);
+    mem_rdlock();
+    if((p = get_inode(path)) != NULL)
+        ret = xattr_list(p,list,size);
+    else
+        ret = xattr_none(path) ? 0 : -ENOENT;
+    mem_unlock();
+    pthread_mutex_unlock(&dir_lock);
+    return ret;
+}
+
+
+static int oshfs_removexattr(const char *path, const char *name)
+{
+    return oshfs_setxattr(path,name,NULL,0,0);
+}
+
+
+//journal模式下等待日志落盘，此前所有修改在崩溃后都能恢复
+static int oshfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    struct inode *node = file_inode(path,fi);
+    wcbuf *w;
+    int ret = 0;
+
+    if(node != NULL && (w = wcb[node->st->st_ino]) != NULL) {
+        pthread_mutex_lock(&w->lock);
+        wc_flush_locked(node->st->st_ino,w);
+        ret = w->error;
+        w->error = 0;
+        pthread_mutex_unlock(&w->lock);
+    }
+    if(journal_commit(jlsn) < 0)
+        ret = -EIO;
+    return ret;
 }
 
 
-//分配inode给文件
-static int malloc_inode()
+//关闭文件时写回写合并缓冲区
+static int oshfs_release(const char *path, struct fuse_file_info *fi)
 {
-    int j = 0,i = 0;
-    int find = 0;
-
-    if(super->free_inodes <= 0)
-        return -ENOSPC;
+    struct inode *node = file_inode(path,fi);
 
-    while(i < INODENUM / 32) {
-            //若bitmap中已经被分配，则询问下一个inode是否被分配
-            // == -1即意味着32位全为1 
-        j = 0;
-        if(inode_bitmap[i] == -1) {
-            i++;
-            continue;
-        }
-        else
-            while(j < 32) {
-            if((inode_bitmap[i] >> j) % 2 ==0) {
-            //移位操作 判断该位是否为0 若未分配（为0）那么返回inode号码
-                find = 1;
-                break;
-            }
-            j++;
-            }
-        if(find == 1)
-            break;
-        i++;
-    }
-    super->free_inodes--;
-    inode_bitmap[i] += (1 << j);
-    node[i*32+j] = mmap(NULL, INODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    return i*32+j;
-} 
+    if(node != NULL)
+        wc_flush(node->st->st_ino);
+    return 0;
+}
 
 
-//分配一个block给文件inode中pointer空指针
-static ssize_t malloc_block(inode *node)
+//卸载时写回所有写合并缓冲区，再做最后一次检查点
+static void oshfs_destroy(void *private_data)
 {
-    int i = 0;
-    int j = 0;
-    int find = 0;
+    int i;
 
-    if(super->free_blocknr <= 0)
-        return -ENOSPC;
+    for(i = 1;i < INODENUM;i++)
+        wc_flush(i);
+    if(options.checkpoint)
+        checkpoint();
+}
 
-    while(i < BLOCKNUM / 32) {
-        //从位图中选择出未分配的block
-        j = 0;
-        if(block_bitmap[i] == -1) {
-            i++;
-            continue;
-        }
-        else
-            while(j < 32) {
-                if((block_bitmap[i] >> j) % 2 ==0) {
-                    find = 1;
-                    break;
-                }
-                j++;
-            }
-        if(find == 1)
-            break;
-        i++;
-    }
-    //给block分配内存
-    mem[i*32+j] = mmap(NULL, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if(mem[i*32+j] == MAP_FAILED) 
-        return -ENOSPC;
-    node->st->st_blocks++;
-    super->free_blocknr--;
-    block_bitmap[i] += (1 << j);
-    return i*32+j;
+
+static int oshfs_statfs(const char *path, struct statvfs *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = BLOCK_SIZE;
+    stbuf->f_frsize = BLOCK_SIZE;
+    stbuf->f_blocks = super->sum_blocknr;
+    stbuf->f_bfree = count_free_blocks();
+    stbuf->f_bavail = stbuf->f_bfree;
+    stbuf->f_files = super->sum_inodes;
+    stbuf->f_ffree = super->free_inodes;
+    stbuf->f_namemax = MAX_FILENAME - 1;
+    return 0;
 }
 
 
-//回收inode中的第n个block
-void free_block(inode *node,ssize_t i)
+//启用fair时替换进操作表的入口：经过调度再调用真正的处理函数
+static int fair_getattr(const char *path, struct stat *stbuf)
 {
-    ssize_t n;
-    int j,k;
-    int32_t *add;
+    fair_req q;
+    int ret;
 
-    n = lookforblnum(node,i,&add);
-    if(mem[n] == NULL)
-        return;
-    *add = 0;
-    munmap(mem[n],BLOCK_SIZE);
-    j = n / 32;
-    k = n % 32;
-    block_bitmap[j] -= (1 << k);
-    node->st->st_blocks--;
-    super->free_blocknr++;
+    fair_begin(&q,FAIR_META);
+    ret = oshfs_getattr(path,stbuf);
+    fair_end(&q);
+    return ret;
 }
 
-//回收inode
-static void free_inode(inode *p)
-{
-    int i,j,k;
-    ssize_t m;
-    int32_t *q,*r;
 
-    if(!p)  return;
-    //回收inode指向的存放block号码的block
-    if(p->bindirect != 0) {
-        j = p->bindirect / 32;
-        k = p->bindirect % 32;
-        block_bitmap[j] -= (1 << k);
-        munmap(mem[p->bindirect],BLOCK_SIZE);
-    }
-    if(p->tindirect != 0) {
-        //回收二级索引block
-        i = 0;
-        q = (int *)mem[p->tindirect];
-        m = *(q + i);
-        while(m != 0 && i < BLOCK_SIZE / 4) {
-            j = m / 32;
-            k = m % 32;
-            block_bitmap[j] -= (1 << k);
-            munmap(mem[m],BLOCK_SIZE);
-            i++;
-            m = *(q + i);
-        }
-        // 释放二级索引块自身
-        j = p->tindirect / 32;
-        k = p->tindirect % 32;
-        block_bitmap[j] -= (1 << k);
-        munmap(mem[p->tindirect],BLOCK_SIZE);
-    }
+static int fair_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+    fair_req q;
+    int ret;
 
-    i = p->st->st_ino;
-    j = i / 32;
-    k = i % 32;
-    inode_bitmap[j] -= (1 << k); 
-    super->free_inodes++;
-    munmap(p,INODE_SIZE);
+    fair_begin(&q,FAIR_META);
+    ret = oshfs_readdir(path,buf,filler,offset,fi);
+    fair_end(&q);
+    return ret;
 }
 
 
-//取得文件的inode
-static struct inode *get_inode(const char *name)
+static int fair_mknod(const char *path, mode_t mode, dev_t dev)
 {
-    struct inode *node = root;
-    //从inode链表中找到正确的node
-    while(node) {
-        if(strcmp(node->filename,name+1)!= 0)
-            node = node->next;
-        else   
-            return node;
-    }
-    return NULL;
+    fair_req q;
+    int ret;
+
+    fair_begin(&q,FAIR_META);
+    ret = oshfs_mknod(path,mode,dev);
+    fair_end(&q);
+    return ret;
 }
 
 
-static void create_inode(const char *filename, const struct stat *st)
+static int fair_open(const char *path, struct fuse_file_info *fi)
 {
-    int t = malloc_inode();
-    struct inode *new = (inode *)node[t];
+    fair_req q;
+    int ret;
 
-    memcpy(new->filename, filename, strlen(filename) + 1);
-    new->st = (struct filestate *)malloc(sizeof(struct filestate));
-    //  由于使用的是struct filestate而非struct stat 因此逐个赋值
-    new->st->st_ino = t;
-    new->st->st_mode = S_IFREG | 0644;
-    new->st->st_uid = fuse_get_context()->uid;
-    new->st->st_gid = fuse_get_context()->gid;
-    new->st->st_blksize = BLOCK_SIZE;
-    new->st->st_blocks = 0;
-    new->bindirect = 0;
-    new->tindirect = 0;
-    for(int i=0;i < BLOCKS_INODE;i++)
-        new->blnum[i] = 0;
-    //  头插法进入inode链表
-    new->next = root->next;
-    root->next = new;
+    fair_begin(&q,FAIR_META);
+    ret = oshfs_open(path,fi);
+    fair_end(&q);
+    return ret;
 }
 
 
-static void *oshfs_init(struct fuse_conn_info *conn)
+static int fair_unlink(const char *path)
 {
-    int i;
+    fair_req q;
+    int ret;
 
-    mem[0] = mmap(NULL, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    mem[1] = mmap(NULL, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	node[0] = mmap(NULL,INODE_SIZE,PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    fair_begin(&q,FAIR_META);
+    ret = oshfs_unlink(path);
+    fair_end(&q);
+    return ret;
+}
 
-    block_bitmap = (int32_t *)mem[1];
-    inode_bitmap = (int32_t *)(mem[0]+1024);
-    memset(inode_bitmap,0,INODENUM / 32 * sizeof(int32_t));
-    memset(block_bitmap,0,BLOCKNUM / 32 * sizeof(int32_t));
-    //superblock的初始化以及root的初始化
-	super = (SuperBlock *)mem[0];
-	super->blocksize = BLOCK_SIZE;
-	super->inodesize = INODE_SIZE;
-	super->sum_inodes = MAX_FILENUM;
-	super->sum_blocknr = BLOCKNUM;
-	super->free_inodes = MAX_FILENUM - 1;
-	super->free_blocknr = BLOCKNUM - 2;
-	super->first_inode = 1;
-	super->first_data = 2;
 
-    root = (inode *)node[0];
-	root->st = (struct filestate *)malloc(sizeof(struct filestate));
-    strcpy(root->filename, "/");
-    //blnum[]中的值为0 意味着无效
-    for(i = 0;i<BLOCKS_INODE; i++)
-        root->blnum[i] = 0;
-    root->bindirect = 0;
-    root->tindirect = 0;
-    root->st->st_ino = 0;
-	root->st->st_uid = getuid();
-    root->st->st_mode = S_IFDIR | 0755;
-    root->st->st_gid = getgid();
-    root->st->st_blksize = BLOCK_SIZE;
-    root->st->st_blocks = 0;
-    root->st->st_size = 0;
+static int fair_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    fair_req q;
+    int ret;
 
-    block_bitmap[0] = 3;
-    inode_bitmap[0] = 1;
-    return NULL;
+    fair_begin(&q,FAIR_META);
+    ret = oshfs_getxattr(path,name,value,size);
+    fair_end(&q);
+    return ret;
 }
 
 
-static int oshfs_getattr(const char *path, struct stat *stbuf)
+static int fair_link(const char *from, const char *to)
 {
-    int ret = 0;
-    struct inode *node = get_inode(path);
+    fair_req q;
+    int ret;
 
-    if(strcmp(path, "/") == 0) {
-        memset(stbuf, 0, sizeof(struct stat));
-        stbuf->st_mode = S_IFDIR | 0755;
-    } else if(node) {
-        //原因同上
-        stbuf->st_ino = node->st->st_ino;
-        stbuf->st_mode = node->st->st_mode;
-        stbuf->st_uid = node->st->st_uid;
-        stbuf->st_gid = node->st->st_gid;
-        stbuf->st_size = node->st->st_size;
-        stbuf->st_blksize = node->st->st_blksize;
-        stbuf->st_blocks = node->st->st_blocks;
-    } else {
-        ret = -ENOENT;
-    }
+    fair_begin(&q,FAIR_META);
+    ret = oshfs_link(from,to);
+    fair_end(&q);
     return ret;
 }
 
 
-static int oshfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+static int fair_rename(const char *from, const char *to)
 {
-    struct inode *p = ((struct inode *)node[0])->next;
-    struct stat *p_st;
+    fair_req q;
+    int ret;
 
-    p_st = (struct stat *)malloc(sizeof(struct stat));
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    while(p) {
-        //原因同上
-        //此外，malloc一个p_st是为了满足filler函数参数中必须是struct stat的要求
-        p_st->st_ino = p->st->st_ino;
-        p_st->st_mode = p->st->st_mode;
-        p_st->st_uid = p->st->st_uid;
-        p_st->st_gid = p->st->st_gid;
-        p_st->st_size = p->st->st_size;
-        p_st->st_blksize = p->st->st_blksize;
-        p_st->st_blocks = p->st->st_blocks;
-        filler(buf,p->filename,p_st,0);
-        p = p->next;
-    }
-    free(p_st);
-    return 0;
+    fair_begin(&q,FAIR_META);
+    ret = oshfs_rename(from,to);
+    fair_end(&q);
+    return ret;
 }
 
 
-static int oshfs_mknod(const char *path, mode_t mode, dev_t dev)
+static int fair_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
 {
-    struct stat st;
-    st.st_mode = S_IFREG | 0644;
-    st.st_uid = fuse_get_context()->uid;
-    st.st_gid = fuse_get_context()->gid;
-    st.st_nlink = 1;
-    st.st_size = 0;
-    st.st_blksize = BLOCK_SIZE;
-    create_inode(path + 1, &st);
-    return 0;
+    fair_req q;
+    int ret;
+
+    fair_begin(&q,FAIR_META);
+    ret = oshfs_setxattr(path,name,value,size,flags);
+    fair_end(&q);
+    return ret;
 }
 
 
-static int oshfs_open(const char *path, struct fuse_file_info *fi)
+static int fair_listxattr(const char *path, char *list, size_t size)
 {
-    return 0;
+    fair_req q;
+    int ret;
+
+    fair_begin(&q,FAIR_META);
+    ret = oshfs_listxattr(path,list,size);
+    fair_end(&q);
+    return ret;
 }
 
 
-static int oshfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+static int fair_removexattr(const char *path, const char *name)
 {
-    int a,b;
-    ssize_t j,k,n;
-    ssize_t off,newoff,min;
-    int32_t *p,*add;
-    struct inode *node = get_inode(path);
-    
-    printf("write\t");
-    node->st->st_size = offset + size;          // 计算文件的新的大小
-    j = offset / BLOCK_SIZE;                    // 记录从哪个block号开始更改
-    off = offset % BLOCK_SIZE;                  // 从block号中哪一字节开始更改
-    
-    if(j >= BLOCKS_INODE && node->bindirect == 0) {
-        //分配一级索引
-        k = malloc_block(node);
-        node->bindirect = k;
-        node->st->st_blocks--;
-    }
+    fair_req q;
+    int ret;
 
-    if(j >= TBLOCK) {
-        //分配二级索引
-        if(node->tindirect == 0) {
-            //分配一个存储block号码的block
-            k = malloc_block(node);
-            node->tindirect = k;
-            node->st->st_blocks--;
-            memset(mem[node->tindirect],0,BLOCK_SIZE);
-        }       
-        a = (j - TBLOCK) / (BLOCK_SIZE / 4);
-        p = (int32_t *)mem[node->tindirect];
-        //分配二级索引中的第二级索引块
-        if(*(p + a) == 0) {
-            k = malloc_block(node);
-            *(p + a) = k;
-            node->st->st_blocks--;
-            memset(mem[k],0,BLOCK_SIZE);
-        }
+    fair_begin(&q,FAIR_META);
+    ret = oshfs_removexattr(path,name);
+    fair_end(&q);
+    return ret;
+}
 
-    }
-    // 找到第j个block的号码
-    n = lookforblnum(node,j,&add);
-    printf("j = %d,offset = %ld,size = %lu n= %ld\t",j,offset,size,n);
-    if(n == 0) {
-        // 若指向的block未分配
-        k = malloc_block(node);
-        *add = k;
-        printf("k = %ld,blnr = %ld\n",k,node->st->st_blocks);
-        memcpy(mem[k],buf,size);
-    }
-    else {
-        // block块已经被分配
-        k = size - (BLOCK_SIZE - off +1);
-        min = size < (BLOCK_SIZE -off +1) ? size:(BLOCK_SIZE -off +1);
-        memcpy(mem[n] + off,buf,min);
-        
-        while(k > 0) {
-            j++;
-            n = lookforblnum(node,j,&add);
-            k = malloc_block(node);
-            *add = k;
-            memcpy(mem[k],buf + off,min);
-            off += min;
-            k -= BLOCK_SIZE;
-        }
-    }
 
-    return size;
+static int fair_release(const char *path, struct fuse_file_info *fi)
+{
+    fair_req q;
+    int ret;
+
+    fair_begin(&q,FAIR_META);
+    ret = oshfs_release(path,fi);
+    fair_end(&q);
+    return ret;
 }
 
 
-//从第beg个块开始释放后面所有的块的内存
-void trun(inode *node,ssize_t beg,ssize_t blnr)
+static int fair_statfs(const char *path, struct statvfs *stbuf)
 {
-    int i,j,k;
-    ssize_t m;
-    int32_t *q;
-
-    for(i = beg;i < blnr;i++)
-        free_block(node,i);
-    printf("beg=%d",beg);
-    if(beg < BLOCKS_INODE && node->bindirect != 0) {
-        //若把间接存放在block里面的block号码空间都释放了
-        //则也应该释放bindirect这个block
-        j = node->bindirect / 32;
-        k = node->bindirect % 32;
-        block_bitmap[j] -= (1 << k);
-        munmap(mem[node->bindirect],BLOCK_SIZE);
-        node->bindirect = 0;
-    }
+    fair_req q;
+    int ret;
 
-    if(beg < TBLOCK && node->tindirect != 0) {
-        //释放二级索引中所有的块
-        i = 0;
-        q = (int32_t *)mem[node->tindirect];
-        m = *(q + i);
-        while(m != 0 && i < BLOCK_SIZE /4) {
-            printf("!!!\n");
-            j = m / 32;
-            k = m % 32;
-            block_bitmap[j] -= (1 << k);
-            munmap(mem[m],BLOCK_SIZE);
-            i++;
-            m = *(q + i);
-        }
-        // 释放二级索引块自身
-        j = node->tindirect / 32;
-        k = node->tindirect % 32;
-        block_bitmap[j] -= (1 << k);
-        munmap(mem[node->tindirect],BLOCK_SIZE);
-        node->tindirect = 0;
-    }
+    fair_begin(&q,FAIR_META);
+    ret = oshfs_statfs(path,stbuf);
+    fair_end(&q);
+    return ret;
 }
 
 
-static int oshfs_truncate(const char *path, off_t size)
+static int fair_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    int i;
-    ssize_t blnr;
-    ssize_t j;
-    ssize_t n,k;
-    int32_t *p,*q;
-    int32_t *add;
-    char *buf;
-    struct inode *node = get_inode(path);
-
-    buf = (char*)malloc(sizeof(char)*BLOCK_SIZE);
-    node->st->st_size = size;
-    blnr = node->st->st_blocks;         //记录inode的block总数
-    j = size / BLOCK_SIZE;              //找到开始截断的第j个block
+    fair_req q;
+    int ret;
 
-    printf("truncate blnr = %d,%lu\n",blnr,size);
-    //把这个块中余下的字符串拷贝到buf中
-    if(size % BLOCK_SIZE != 0) {
-        n = lookforblnum(node,j,&add);
-        printf("n = %ld\n",n);
-        memcpy(buf,mem[n],size % BLOCK_SIZE);
-        trun(node,j,blnr);
-        k = malloc_block(node);
-        *add = k;
-        memcpy(mem[k],buf,size % BLOCK_SIZE);
-    }
-    else {
-        //从第j个块开始，把后面的块释放掉
-        printf("%lu",size);
-        trun(node,j,blnr);
-        }
-    free(buf);
-    return 0;
+    fair_begin(&q,FAIR_DATA);
+    ret = oshfs_read(path,buf,size,offset,fi);
+    fair_end(&q);
+    return ret;
 }
 
 
+static int fair_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    fair_req q;
+    int ret;
+
+    fair_begin(&q,FAIR_DATA);
+    ret = oshfs_write(path,buf,size,offset,fi);
+    fair_end(&q);
+    return ret;
+}
+
 
-static size_t oshfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+static int fair_truncate(const char *path, off_t size)
 {
-    int i = 0;
-    int j,m;
-    ssize_t n,k,off,min;
-    int32_t *p,*q;
-    int32_t *add;
-    struct inode *node = get_inode(path);
-    size_t ret = size;
+    fair_req q;
+    int ret;
 
-    printf("read\n");
-    if(offset + size > node->st->st_size)
-        ret = node->st->st_size - offset;
-    
-    j = offset / BLOCK_SIZE;            // 从k号开始读block,找到第k个block
-    m = offset % BLOCK_SIZE;            // m表示块内偏移量
-    k = ret - (BLOCK_SIZE - m);         // k表示多余的字符长度
-    min = ret < (BLOCK_SIZE - m) ? ret : (BLOCK_SIZE -m);  // min取最小的字节
-    printf("offset = %lu\n",offset);
-    n = lookforblnum(node,j,&add);
-    printf("n = %ld k = %ld\n",n,k);
-    memcpy(buf,mem[n] + m,min);
-    off = min;
-
-    while(k > 0) {
-        //找到下一个块 读取内容
-        printf("enter\n");
-        j++;
-        n = lookforblnum(node,j,&add);
-        printf("!!n = %ld\n",n);
-        min = k < BLOCK_SIZE ? k : BLOCK_SIZE;
-        memcpy(buf + off,mem[n],min);
-        printf("off = %ld",off);
-        off += BLOCK_SIZE;
-        k -= BLOCK_SIZE;
-    }
-    
+    fair_begin(&q,FAIR_DATA);
+    ret = oshfs_truncate(path,size);
+    fair_end(&q);
     return ret;
 }
 
 
-static int oshfs_unlink(const char *path)
+static int fair_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
-    struct inode *p = (inode *)node[0];
-	struct inode *name = get_inode(path);
-    int i;
-    ssize_t blnr = p->st->st_blocks;
-    //找到对应的inode
-	while(p) {
-		if (strcmp(p->next->filename ,name->filename) != 0)
-			p = p->next;
-		else {
-			p->next = name->next;
-            for(i = 0;i < blnr;i++)
-                free_block(p,i);
-			free_inode(name);
-			break;
-		}
-	}
+    fair_req q;
+    int ret;
 
-    return 0;
+    fair_begin(&q,FAIR_DATA);
+    ret = oshfs_fsync(path,datasync,fi);
+    fair_end(&q);
+    return ret;
 }
 
 
@@ -617,9 +5073,66 @@ static const struct fuse_operations op = {
     .truncate = oshfs_truncate,
     .read = oshfs_read,
     .unlink = oshfs_unlink,
+    .rename = oshfs_rename,
+    .link = oshfs_link,
+    .statfs = oshfs_statfs,
+    .destroy = oshfs_destroy,
+    .fsync = oshfs_fsync,
+    .release = oshfs_release,
+    .setxattr = oshfs_setxattr,
+    .getxattr = oshfs_getxattr,
+    .listxattr = oshfs_listxattr,
+    .removexattr = oshfs_removexattr,
 };
 
 int main(int argc, char *argv[])
 {
-    return fuse_main(argc, argv, &op, NULL);
+    int ret;
+    char opt[128];
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_operations ops;
+
+    if(fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+        return 1;
+    if(options.blocksize) {
+        if(block_shift_of(options.blocksize) < 0) {
+            fprintf(stderr, "blocksize must be a power of 2 between %d and %d\n",
+                    1 << MIN_BLOCK_SHIFT, 1 << MAX_BLOCK_SHIFT);
+            return 1;
+        }
+        blk_shift = block_shift_of(options.blocksize);
+    }
+    if(options.build)
+        return build_image(options.build) < 0;
+    //libfuse自己也要知道max_write，才会分配足够大的请求缓冲区
+    snprintf(opt, sizeof(opt), "-omax_write=%u,big_writes", options.max_write);
+    fuse_opt_add_arg(&args, opt);
+    if(options.kcache) {
+        snprintf(opt, sizeof(opt), "-oentry_timeout=%g,attr_timeout=%g,negative_timeout=%g",
+                 options.cache_timeout, options.cache_timeout, options.cache_timeout);
+        fuse_opt_add_arg(&args, opt);
+    }
+    ops = op;
+    if(options.fair) {
+        ops.getattr = fair_getattr;
+        ops.readdir = fair_readdir;
+        ops.mknod = fair_mknod;
+        ops.open = fair_open;
+        ops.unlink = fair_unlink;
+        ops.getxattr = fair_getxattr;
+        ops.read = fair_read;
+        ops.write = fair_write;
+        ops.truncate = fair_truncate;
+        ops.rename = fair_rename;
+        ops.link = fair_link;
+        ops.statfs = fair_statfs;
+        ops.fsync = fair_fsync;
+        ops.release = fair_release;
+        ops.setxattr = fair_setxattr;
+        ops.listxattr = fair_listxattr;
+        ops.removexattr = fair_removexattr;
+    }
+    ret = fuse_main(args.argc, args.argv, &ops, NULL);
+    fuse_opt_free_args(&args);
+    return ret;
 }